@@ -40,52 +40,191 @@
 **          |  ----- ----- -----
 **          ----------------------> nx
 **
+** The grid is split between the MPI ranks in blocks, over a
+** periodic px*py Cartesian grid of ranks.  Each rank only holds
+** its own block plus a frame of halo (ghost) cells one cell
+** wide, so the local arrays are (local_ny+2)*(local_nx+2) cells:
+**
+**   local row 0                south halo (global row start-1)
+**   local rows 1..local_ny     owned rows (global rows start..end)
+**   local row local_ny+1       north halo (global row end+1)
+**
+** and likewise local columns 0, 1..local_nx and local_nx+1 for
+** the west halo, the owned columns start_x..end_x and the east
+** halo.  The corners of the frame come from the diagonal
+** neighbours.  Halos wrap around periodically at the edges of
+** the grid, so with a single rank along an axis they are copies
+** of its own cells from the other side.
+**
+** By default every row of ranks gets the same no. of rows, give or
+** take one, and likewise for the columns.  With --balance fluid the
+** cuts are placed so that each row (column) of ranks gets about the
+** same no. of fluid cells instead, which evens out the work of the
+** kernels that skip the obstacles.  The cuts are made once, in
+** partition(), and every rank looks its block up in them.  With
+** --rebalance N the ranks time their steps, and every N steps, if
+** the slowest took over IMBALANCE times the average, rebalance()
+** moves the cuts in proportion to the measured cost of the cells
+** and migrates the cells between the ranks.
+**
+** With --kernel blocked the frame is --steps cells deep instead,
+** and the halos are only exchanged once every that many steps:
+** each rank recomputes the halo cells it needs in the meantime, on
+** a frame that shrinks by one cell per step, and sweeps the steps
+** over its block as a wavefront of tiles of rows so that a tile is
+** reused from cache by the following steps (see time_block()).
+**
 ** Note the names of the input parameter and obstacle files
-** are passed on the command line, e.g.:
+** are passed on the command line, after any options, e.g.:
 **
 **   d2q9-bgk.exe input.params obstacles.dat
+**   d2q9-bgk.exe --kernel split --grid 4x2 input.params obstacles.dat
+**   d2q9-bgk.exe --diag 100 input.params obstacles.dat
+**   d2q9-bgk.exe --kernel blocked --steps 8 input.params obstacles.dat
+**
+** The average velocity is streamed to av_vels.dat every --diag
+** steps (every step by default, never with --diag 0).  The
+** final state is written by all the ranks together with MPI-IO,
+** as text or with --output binary as raw planes of floats, which
+** state2txt turns back into the text format.
+**
+** A long run can be split over several jobs: --checkpoint N saves
+** the whole grid every N steps, and a job started with --restart
+** carries on from the last checkpoint, on any grid of ranks, e.g.:
+**
+**   d2q9-bgk.exe --checkpoint 1000 input.params obstacles.dat
+**   d2q9-bgk.exe --checkpoint 1000 --restart input.params obstacles.dat
+**
+** With --microbench N the kernels are timed on their own instead,
+** on a single rank, on grids from 16x16 up to NxN cells to go from
+** the first level of cache out to main memory, e.g.:
+**
+**   OMP_NUM_THREADS=8 d2q9-bgk.exe --microbench 2048
+**
+** Each is reported in bytes and flops per second, as counted in
+** microbench(), next to the bandwidth of STREAM's triad over as many
+** bytes: a kernel close to it is as fast as its memory traffic
+** allows.  Where perf_event_open() is allowed, the instructions per
+** cycle and the traffic the last level cache misses make are given
+** too.
+**
+** With --timing FILE every rank keeps the time it spends in each
+** phase of the run (see enum phase), and the master writes them to
+** FILE as JSON at the end, with their spread over the ranks and the
+** lattice updates per second.
 **
 ** Be sure to adjust the grid dimensions in the parameter file
-** if you choose a different obstacle file.
+** if you choose a different obstacle file.  Large obstacle files
+** are quicker to load in the binary run-length form written by
+** obstacles2rle; the master reads either form and sends each rank
+** only its own block.
 */
 
+/* for syscall(), which the microbenchmarks open their counters with */
+#define _GNU_SOURCE
+
 #include<stdio.h>
 #include<stdlib.h>
+#include<string.h>
+#include<limits.h>
 #include<time.h>
 #include<sys/time.h>
 #include<sys/resource.h>
+#include<unistd.h>
+#ifdef __linux__
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
+#endif
 #include "mpi.h"
+#ifdef _OPENMP
+#include<omp.h>
+#endif
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
+#define FINALSTATEBIN   "final_state.bin"
+#define STATE_MAGIC     "D2Q9"  /* first bytes of a binary final state */
+#define CHECKPOINTFILE  "checkpoint.dat"
+#define CHECKPOINTTMP   "checkpoint.tmp"  /* renamed once complete */
+#define CHECK_MAGIC     "D2CK"  /* first bytes of a checkpoint */
+#define OBSTACLE_MAGIC  "D2OB"  /* first bytes of a binary obstacle file */
 #define AVVELSFILE      "av_vels.dat"
+#define CELL_CHARS      96      /* room for one line of the final state */
 #define MASTER 0
+#define TAG_HALO        10      /* +direction travelled, halo cells */
+#define TAG_HALO_RETURN 20      /* +direction travelled, AA densities sent back */
+#define TAG_OBSTACLES   30      /* a rank's block of the obstacle map */
+#define ALIGNMENT       64      /* bytes; each speed plane starts on a cache line */
+#define LINE_BYTES      64      /* fetched from memory per last level cache miss */
+#define BENCH_SECONDS   0.2     /* least time each microbenchmark runs for */
+#define COLLIDE_FLOPS   120     /* per fluid cell, counted from relax() */
+#define TILE_ROWS       16      /* rows per tile of a time block, at least one per thread */
+#define IMBALANCE       1.10    /* slowest over mean busy time of the ranks to rebalance at */
+#define WEIGHT_SCALE    (1<<20) /* largest weight of a row or column when rebalancing */
 
+/*
+** Vector types for the collision kernel.  Build with -mavx512f,
+** -mavx2 or -march=native to process VLEN cells per instruction;
+** otherwise only the scalar loop is compiled.  The obstacle map
+** holds one byte per cell, which vmask() widens into a lane mask.
+**
+** Build with -fopenmp as well to sweep the rows of each rank's
+** block across a team of threads.  Only the master thread calls
+** MPI (MPI_THREAD_FUNNELED), so a few ranks per node can share
+** the cores with fewer, larger halo messages between them.
+*/
+#if defined(__AVX512F__)
+#include<immintrin.h>
+#define VLEN 16
+typedef __m512    t_vec;
+typedef __mmask16 t_mask;
+#define vset1(x)      _mm512_set1_ps(x)
+#define vload(p)      _mm512_loadu_ps(p)
+#define vstore(p,v)   _mm512_storeu_ps(p,v)
+#define vadd(a,b)     _mm512_add_ps(a,b)
+#define vsub(a,b)     _mm512_sub_ps(a,b)
+#define vmul(a,b)     _mm512_mul_ps(a,b)
+#define vdiv(a,b)     _mm512_div_ps(a,b)
+#define vmask(p)      _mm512_cmpneq_epi32_mask(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(p))), _mm512_setzero_si512())
+#define vblend(m,a,b) _mm512_mask_blend_ps(m,a,b)    /* b where m is set, else a */
+typedef __m512i   t_ivec;
+#define vloadi(p)     _mm512_loadu_si512(p)
+#define vpull(p,i,b)  _mm512_mask_i32gather_ps(b, _mm512_cmpge_epi32_mask(i, _mm512_setzero_si512()), i, p, 4)  /* p[i], or b where i < 0 */
+#elif defined(__AVX2__)
+#include<immintrin.h>
+#define VLEN 8
+typedef __m256 t_vec;
+typedef __m256 t_mask;
+#define vset1(x)      _mm256_set1_ps(x)
+#define vload(p)      _mm256_loadu_ps(p)
+#define vstore(p,v)   _mm256_storeu_ps(p,v)
+#define vadd(a,b)     _mm256_add_ps(a,b)
+#define vsub(a,b)     _mm256_sub_ps(a,b)
+#define vmul(a,b)     _mm256_mul_ps(a,b)
+#define vdiv(a,b)     _mm256_div_ps(a,b)
+#define vmask(p)      _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(p))), _mm256_setzero_si256()))
+#define vblend(m,a,b) _mm256_blendv_ps(a,b,m)         /* b where m is set, else a */
+typedef __m256i t_ivec;
+#define vloadi(p)     _mm256_loadu_si256((const __m256i*)(p))
+#define vpull(p,i,b)  _mm256_mask_i32gather_ps(b, p, i, _mm256_castsi256_ps(_mm256_cmpgt_epi32(i, _mm256_set1_epi32(-1))), 4)  /* p[i], or b where i < 0 */
+#else
+#define VLEN 1
+#endif
+
+#if VLEN > 1
+/* sum of the lanes of v */
+static inline float vhadd(t_vec v)
+{
+  float lanes[VLEN];
+  float sum = 0.0f;
+  int ll;
 
-//-----------------------__Average File----------------------------
-
-FILE *ofp;
-char *mode = "r";
-char outputFilename[] = "farmTimes.t";
-
-void openFile(){
-    ofp = fopen(outputFilename, "a+");
-
-    if (ofp == NULL) {
-        fprintf(stderr, "Can't open output file %s!\n",
-            outputFilename);
-    }
-}
-
-void printF(double what){
-    fprintf(ofp, "%.6lf ", what);
-    //printf("%.6lf ", what);
+  vstore(lanes, v);
+  for(ll=0;ll<VLEN;ll++) sum += lanes[ll];
+  return sum;
 }
-
-//-----------------------------------------------------------
-
-
-
+#endif
 
 
 /* struct to hold the parameter values */
@@ -97,52 +236,327 @@ typedef struct {
   float density;       /* density per link */
   float accel;         /* density redistribution */
   float omega;         /* relaxation parameter */
-  int rest;
+  int start;            /* first global row owned by this rank */
+  int end;              /* last global row owned by this rank */
+  int local_ny;         /* no. of rows owned by this rank */
+  int tot_cells;        /* no. of fluid cells in the whole grid */
+  int start_x;          /* first global column owned by this rank */
+  int end_x;            /* last global column owned by this rank */
+  int local_nx;         /* no. of columns owned by this rank */
+  int width;            /* row stride of the local arrays, local_nx+2*depth */
+  int depth;            /* cells in the halo frame, and steps per time block */
+  int origin;           /* offset of local cell (0,0) in the local arrays */
+  int px;               /* no. of ranks across x, 0 to choose one */
+  int py;               /* no. of ranks across y */
+  int kernel;           /* enum kernel, from the command line */
+  int diag_every;       /* steps between average velocity samples, 0 for none */
+  int output;           /* enum output, from the command line */
+  int checkpoint_every; /* steps between checkpoints, 0 for none */
+  int restart;          /* TRUE to carry on from the checkpoint file */
+  int balance;          /* enum balance, from the command line */
+  int rebalance_every;  /* steps between checks of the balance, 0 for none */
+  const char* timing;   /* file for the timing report, or NULL for none */
+  int microbench;       /* largest grid of the microbenchmarks, 0 to run the model */
 } t_param;
 
-/* struct to hold the 'speed' values */
+/* struct to hold the 'speed' values as a structure of arrays:
+** speeds[kk] is a plane holding speed kk of every local cell, so
+** that neighbouring cells are contiguous and can be vectorised */
 typedef struct {
-  float speeds[NSPEEDS];
+  float* speeds[NSPEEDS];
+  int    swapped;       /* TRUE while in the layout left by an AA even step */
+  int*   index;         /* slot of each local cell of a sparse lattice, else NULL */
 } t_speed;
 
 enum boolean { FALSE, TRUE };
 
+/* how a timestep sweeps the lattice */
+enum kernel {
+  KERNEL_FUSED,   /* one pull-style stream, rebound & collide sweep */
+  KERNEL_SPLIT,   /* separate propagate, rebound & collision sweeps */
+  KERNEL_AA,      /* in-place AA pattern, alternating even & odd steps */
+  KERNEL_SPARSE,  /* like KERNEL_FUSED, on a lattice of the fluid cells only */
+  KERNEL_BLOCKED  /* KERNEL_FUSED sweeps, depth steps at a time per tile */
+};
+
+/* how the grid is cut into the blocks of the ranks */
+enum balance {
+  BALANCE_EVEN,   /* the same no. of rows and columns, give or take one */
+  BALANCE_FLUID   /* the same no. of fluid cells, give or take a row or column */
+};
+
+/* the phases of a run each rank keeps time of, for write_timings() */
+enum phase {
+  PHASE_ACCELERATE,  /* accelerate_flow() */
+  PHASE_HALO_POST,   /* posting the halo messages, packing included */
+  PHASE_HALO_WAIT,   /* waiting for them to complete */
+  PHASE_PROPAGATE,   /* propagate() (KERNEL_SPLIT) */
+  PHASE_REBOUND,     /* rebound() (KERNEL_SPLIT) */
+  PHASE_COLLIDE,     /* collision() or the fused sweeps of the other kernels */
+  PHASE_REDUCE,      /* reducing and writing the average velocities */
+  PHASE_CHECKPOINT,  /* writing checkpoints */
+  PHASE_REBALANCE,   /* checking the balance and migrating cells */
+  PHASE_OUTPUT,      /* the Reynolds number and the final state */
+  NPHASES
+};
+
+/* the kernels microbench() times: STREAM's triad, for the memory
+** bandwidth the others are held up against, then those of a step */
+enum bench {
+  BENCH_TRIAD,       /* a[i] = b[i] + s*c[i] */
+  BENCH_PROPAGATE,   /* propagate() */
+  BENCH_REBOUND,     /* rebound() */
+  BENCH_COLLISION,   /* collision() */
+  BENCH_FUSED,       /* stream_collide(), i.e. all three of them at once */
+  BENCH_HALO,        /* halo_start() and halo_finish() */
+  NBENCH
+};
+
+/* hardware counters read around each microbenchmark, per thread */
+enum counter {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_LLC_MISSES,
+  NCOUNTERS
+};
+
+/* how the final state is written */
+enum output {
+  OUTPUT_TEXT,    /* one line per cell in final_state.dat */
+  OUTPUT_BINARY   /* t_state_header then raw planes in final_state.bin */
+};
+
+/* header of a binary final state.  It is followed by four planes of
+** ny*nx values in row major order: u_x, u_y and pressure as floats
+** of dtype bytes, then the obstacles as one byte each */
+typedef struct {
+  char magic[4];        /* STATE_MAGIC */
+  int  nx;              /* no. of cells in x-direction */
+  int  ny;              /* no. of cells in y-direction */
+  int  dtype;           /* bytes per float value */
+} t_state_header;
+
+/* header of a checkpoint, followed by the densities of the whole
+** grid as NSPEEDS planes of ny*nx floats, in the natural layout and
+** row major order, so that any grid of ranks can read it back */
+typedef struct {
+  char magic[4];        /* CHECK_MAGIC */
+  int  nx;              /* no. of cells in x-direction */
+  int  ny;              /* no. of cells in y-direction */
+  int  iters;           /* no. of timesteps already done */
+  long long av_bytes;   /* length of av_vels.dat up to then */
+} t_check_header;
+
+/* header of a binary obstacle file, followed by nruns runs of
+** blocked cells along a row, each given by three ints: the row, the
+** first column and the no. of cells.  Any other obstacle file is
+** read as text, one blocked cell per line: x y 1 */
+typedef struct {
+  char magic[4];        /* OBSTACLE_MAGIC */
+  int  nx;              /* no. of cells in x-direction */
+  int  ny;              /* no. of cells in y-direction */
+  int  nruns;           /* no. of runs */
+} t_obstacle_header;
+
+/* struct describing one halo exchange with the eight neighbours.
+** Directions are numbered like the speeds 1..8 pointing that way,
+** so send[dd] is what goes to the neighbour in direction dd and
+** recv[dd] what arrives from it; entry 0 is unused */
+typedef struct {
+  int    aa_return;             /* TRUE for the densities an AA even step leaves in the halos */
+  int    tag;                   /* base message tag */
+  MPI_Datatype send[NSPEEDS];   /* the densities sent, in place */
+  MPI_Datatype recv[NSPEEDS];   /* the densities received, in place */
+  MPI_Request requests[2*(NSPEEDS-1)];  /* receives, then sends */
+} t_halo;
+
+/* struct describing a sparse lattice (KERNEL_SPARSE), which only
+** holds the fluid cells, in slots: first the interior of the block,
+** then the owned cells along its edges, then the halo cells.  The
+** obstacles all share the one slot after those, which no sweep
+** touches, so that the owned cells can still be reached by row and
+** column through index */
+typedef struct {
+  int* index;             /* slot of each local cell, nslots for obstacles */
+  int* upstream[NSPEEDS]; /* slot each owned fluid cell pulls speed kk from,
+                          ** or -1 to bounce it back; entry 0 is unused */
+  int  ninner;            /* no. of slots in the interior */
+  int  nfluid;            /* no. of owned slots */
+  int  nslots;            /* no. of slots, halos included */
+} t_sparse;
+
+/* struct listing the owned obstacle cells that rebound() has to
+** mirror (KERNEL_SPLIT), by speed: an obstacle only needs speed kk
+** when the neighbour that speed heads for is fluid, as anything it
+** sends into another obstacle is bounced straight back */
+typedef struct {
+  int* cells[NSPEEDS];    /* local index of each such obstacle cell;
+                          ** entry 0 is unused */
+  int  count[NSPEEDS];    /* and the no. of them */
+} t_boundary;
+
+/* lattice velocity of each speed and the speed opposite it */
+static const int cx[NSPEEDS] = { 0, 1, 0, -1, 0, 1, -1, -1, 1 };
+static const int cy[NSPEEDS] = { 0, 0, 1, 0, -1, 1, 1, -1, -1 };
+static const int opposite[NSPEEDS] = { 0, 3, 4, 1, 2, 7, 8, 5, 6 };
+
+/* names of the kernels and phases in the timing report */
+static const char* kernel_names[] = { "fused", "split", "aa", "sparse", "blocked" };
+static const char* phase_names[NPHASES] = {
+  "accelerate", "halo_post", "halo_wait", "propagate", "rebound",
+  "collide", "reduce", "checkpoint", "rebalance", "output"
+};
+static const char* bench_names[NBENCH] = {
+  "triad", "propagate", "rebound", "collision", "fused", "halo"
+};
+
+/* the slot holding speed kk of local cell (ii,jj), width being the
+** row stride.  In the swapped layout it sits in the neighbour that
+** speed is heading for, under the opposite speed; for the edge
+** cells of the block that neighbour is a halo cell.  A sparse
+** lattice looks the slot up instead */
+static inline float* speed(const int width, t_speed* cells, int ii, int jj, int kk)
+{
+  if(cells->index) return &cells->speeds[kk][cells->index[ii*width + jj]];
+  if(cells->swapped) {
+    ii += cy[kk];
+    jj += cx[kk];
+    kk = opposite[kk];
+  }
+  return &cells->speeds[kk][ii*width + jj];
+}
+
 /*
 ** function prototypes
 */
 
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
-         t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, 
-         int** obstacles_ptr, float** av_vels_ptr);
+         t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+         unsigned char** obstacles_ptr);
+
+/* pick the px*py grid of ranks for the grid of cells */
+void choose_grid(t_param* params);
+
+/* cut the grid into the blocks of the ranks, for all the kernels */
+void partition(t_param* params, const unsigned char* map);
+
+/* set up this rank's block of the grid as the cuts have it: its
+** share of the obstacles, its lattices, filled with the initial
+** densities, and its halo exchanges / release them all again */
+void build_block(t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+                 unsigned char** obstacles_ptr);
+void free_block(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+                unsigned char** obstacles_ptr);
 
-/* 
+/* if the ranks spent too long apart on their last steps, busy being
+** this one's time less its waits for halos, move the cuts to even
+** them out and migrate the cells to their new blocks */
+void rebalance(t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+               unsigned char** obstacles_ptr, double busy);
+
+/* cut the n cells along an axis into nparts parts of at least minimum
+** cells, evenly or in proportion to weight[]; part p gets cells
+** cut[p]..cut[p+1]-1 */
+void cut_axis(int n, int nparts, const int* weight, int minimum, int* cut);
+
+/* allocate / free the planes of a lattice of ncells cells, with
+** local cell (0,0) origin cells into each plane */
+t_speed* alloc_speeds(int ncells, int origin);
+void free_speeds(t_speed* lattice, int origin);
+
+/* set up the slots of a sparse lattice for the fluid cells in obstacles */
+int sparse_init(const t_param params, unsigned char* obstacles);
+
+/* list the owned obstacle cells next to fluid, for rebound() */
+void boundary_init(const t_param params, unsigned char* obstacles);
+
+/* set up / release the datatypes of a halo exchange on grids shaped like cells */
+void halo_init(const t_param params, t_halo* halo, t_speed* cells);
+void halo_free(t_halo* halo);
+
+/*
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** accelerate_flow(), halo_start() & halo_finish() on the halo cells,
+** and then propagate(), rebound() & collision() (KERNEL_SPLIT).
+** The fused and AA kernels work on boxes of owned cells instead,
+** rows first..last by columns first_col..last_col, so that the
+** interior of the block is computed between halo_start() and
+** halo_finish() while the halo messages are in flight:
+** stream_collide() (KERNEL_FUSED), or for KERNEL_AA alternately
+** aa_even() and aa_odd(), the latter after sending back what the
+** even step left in the halo cells.  KERNEL_SPARSE sweeps the
+** slots of the fluid cells with sparse_collide(), the interior
+** ones first.  KERNEL_BLOCKED runs several steps per call of
+** time_block() instead, with the stream_collide() sweeps of each.
+** The sweeps that relax the cells return the sum of their x
+** velocities, which collision leaves unchanged, so timestep()
+** returns this rank's share of the average velocity for free
 */
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+float timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles);
+int halo_start(const t_param params, t_speed* cells, t_halo* halo);
+int halo_finish(const t_param params, t_speed* cells, t_halo* halo);
+void time_block(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles,
+                int nsteps, float* u_x);
+int accelerate_flow(const t_param params, t_speed* cells, unsigned char* obstacles,
+                    int first, int last, int first_col, int last_col);
+int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles);
+int rebound(t_speed* cells, t_speed* tmp_cells);
+float collision(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles);
+float stream_collide(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles,
+                     int first, int last, int first_col, int last_col);
+float aa_even(const t_param params, t_speed* cells, unsigned char* obstacles,
+              int first, int last, int first_col, int last_col);
+float aa_odd(const t_param params, t_speed* cells, unsigned char* obstacles,
+             int first, int last, int first_col, int last_col);
+float sparse_collide(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                     int first, int last);
+int write_values(const t_param params, t_speed* cells, unsigned char* obstacles);
+
+/* save the densities after iters timesteps, and av_bytes (only
+** used on the master), to the checkpoint file / restore them from it */
+int write_checkpoint(const t_param params, t_speed* cells, int iters, long long av_bytes);
+int read_checkpoint(const t_param params, t_speed* cells, int* iters, long long* av_bytes);
+
+/* gather the phase times of all the ranks and have the master write
+** them to params.timing as JSON, with their min, mean and max, the
+** imbalance (max over mean) and the lattice updates per second of
+** the iters steps run in elapsed seconds */
+void write_timings(const t_param params, double elapsed, int iters);
+
+/* time each kernel on a single rank, on grids of 16x16 cells up to
+** params->microbench squared, and print the bytes and flops per
+** second each achieves against those of STREAM's triad over as
+** many bytes, with hardware counters where the kernel allows them */
+void microbench(t_param* params);
+
+/* wait for the reduction of a velocity sample and, on the master,
+** append the average at step to fp (nothing while step is negative) */
+void write_av_vel(FILE* fp, const t_param params, MPI_Request* request,
+                  int step, float* sum);
 
 /* finalise, including freeing up allocated memory */
 int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-       int** obstacles_ptr, float** av_vels_ptr);
+       unsigned char** obstacles_ptr);
 
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
 float total_density(const t_param params, t_speed* cells);
 
-/* compute average velocity */
-float av_velocity(const t_param params, t_speed* cells, int* obstacles);
+/* sum of the x velocities of the fluid cells owned by this rank,
+** from a sweep of its own (timestep() gives the same for free) */
+float local_velocity(const t_param params, t_speed* cells, unsigned char* obstacles);
+
+/* compute average velocity (result is only valid on the master) */
+float av_velocity(const t_param params, t_speed* cells, unsigned char* obstacles);
 
 /* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles);
+float calc_reynolds(const t_param params, t_speed* cells, unsigned char* obstacles);
 
 /* utility functions */
+void parse_args(int argc, char* argv[], t_param* params,
+         char** paramfile_ptr, char** obstaclefile_ptr);
 void die(const char* message, const int line, const char *file);
 void usage(const char* exe);
 
@@ -151,15 +565,18 @@ void usage(const char* exe);
 ** initialise, timestep loop, finalise
 */
 
-int atyt=1;
-
   int rank;           /* process rank */
   int nprocs;         /* number of processes */
-  int source;         /* rank of sender */
-  int dest = MASTER;  /* all procs send to master */
-  int tag = 0;        /* message tag */
-  MPI_Status status;  /* struct to hold message status */ 
-  MPI_Request request;
+  MPI_Comm comm;      /* periodic Cartesian grid of the ranks */
+  int neighbour[NSPEEDS];  /* rank of the neighbour in each direction 1..8 */
+  t_halo halo;        /* halo cells, exchanged before every step */
+  t_halo halo_ret;    /* densities an AA even step leaves in the halos */
+  t_sparse sparse;    /* slots of the fluid cells, for KERNEL_SPARSE */
+  t_boundary boundary;  /* obstacle cells next to fluid, for KERNEL_SPLIT */
+  int* row_cut;       /* first row of each row of ranks, then ny */
+  int* col_cut;       /* first column of each column of ranks, then nx */
+  unsigned char* obstacle_map;  /* of the whole grid, on the master while the cuts may move */
+  double phase_time[NPHASES];  /* time this rank has spent in each phase */
 
 
 int main(int argc, char* argv[])
@@ -169,660 +586,1566 @@ int main(int argc, char* argv[])
   t_param  params;            /* struct to hold parameter values */
   t_speed* cells     = NULL;  /* grid containing fluid densities */
   t_speed* tmp_cells = NULL;  /* scratch space */
-  int*     obstacles = NULL;  /* grid indicating which cells are blocked */
-  float*  av_vels   = NULL;  /* a record of the av. velocity computed for each timestep */
+  unsigned char* obstacles = NULL;  /* grid indicating which cells are blocked */
+  FILE*    av_fp     = NULL;  /* where the master streams the av. velocities */
   int      ii;                /* generic counter */
+  int      step;              /* timestep within a time block */
+  int      nsteps;            /* no. of steps in it */
+  float*   l_u_x;             /* this rank's velocity sum after each of them */
+  float    av_send;           /* a sampled one, on its way to the master */
+  float    av_sum;            /* and the total over the ranks */
+  int      av_step = -1;      /* step of the sample in flight, if any */
+  long long av_bytes = 0;     /* length of av_vels.dat at the last checkpoint */
+  int      first = 0;         /* first timestep to run */
+  MPI_Request av_request = MPI_REQUEST_NULL;
+  double   busy = 0.0;        /* time spent on steps since the last rebalance */
+  double   waited = 0.0;      /* of which waiting for halos, as of then */
+  double   phase_tic;         /* start of the last phase timed here */
+  float    reynolds;          /* Reynolds number of the final state */
   struct timeval timstr;      /* structure to hold elapsed time */
   struct rusage ru;           /* structure to hold CPU time--system and user */
   double tic,toc;             /* floating point numbers to calculate elapsed wallclock time */
   double usrtim;              /* floating point number to record elapsed user CPU time */
   double systim;              /* floating point number to record elapsed system CPU time */
+  int provided;               /* level of thread support MPI gives us */
+
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+#ifdef _OPENMP
+  if(provided < MPI_THREAD_FUNNELED)
+    die("the MPI library does not support threads",__LINE__,__FILE__);
+#endif
 
   /* parse the command line */
-  if(argc != 3) {
-    usage(argv[0]);
-  }
-  else{
-    paramfile = argv[1];
-    obstaclefile = argv[2];
+  parse_args(argc, argv, &params, &paramfile, &obstaclefile);
+
+  /* or just time the kernels */
+  if(params.microbench > 0) {
+    microbench(&params);
+    MPI_Finalize();
+    return EXIT_SUCCESS;
   }
 
   /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
+  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles);
+  if(params.restart) read_checkpoint(params, cells, &first, &av_bytes);
+  l_u_x = (float*)malloc(sizeof(float)*params.depth);
+  if (l_u_x == NULL)
+    die("cannot allocate memory for the velocity sums",__LINE__,__FILE__);
+
+  /* on a restart, drop any samples written after the checkpoint */
+  if(rank==MASTER) {
+    av_fp = fopen(AVVELSFILE, params.restart ? "a" : "w");
+    if (av_fp == NULL) {
+      die("could not open file output file",__LINE__,__FILE__);
+    }
+    if(params.restart) {
+      fseek(av_fp, 0, SEEK_END);
+      if(ftell(av_fp) < av_bytes || ftruncate(fileno(av_fp), av_bytes) != 0)
+        die("av_vels.dat does not match the checkpoint",__LINE__,__FILE__);
+    }
+  }
 
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr,NULL);
   tic=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
+  /* every diag_every steps the velocity sum is reduced onto the
+  ** master while the following steps are computed, and written out
+  ** when the next sample is taken (or a checkpoint, which must hold
+  ** all the samples before it).  The steps are run a time block
+  ** of up to depth at once (a single step for all but KERNEL_BLOCKED),
+  ** which stops short of the next checkpoint */
+  for (ii=first;ii<params.maxIters;ii+=nsteps) {
+    nsteps = params.maxIters - ii;
+    if(nsteps > params.depth) nsteps = params.depth;
+    if(params.checkpoint_every > 0 && nsteps > params.checkpoint_every - ii % params.checkpoint_every)
+      nsteps = params.checkpoint_every - ii % params.checkpoint_every;
+    if(params.rebalance_every > 0 && nsteps > params.rebalance_every - ii % params.rebalance_every)
+      nsteps = params.rebalance_every - ii % params.rebalance_every;
+    phase_tic = MPI_Wtime();
+    if(params.kernel == KERNEL_BLOCKED)
+      time_block(params,cells,tmp_cells,obstacles,nsteps,l_u_x);
+    else
+      l_u_x[0] = timestep(params,cells,tmp_cells,obstacles);
+    busy += MPI_Wtime() - phase_tic;
+
+    for(step=ii;step<ii+nsteps;step++) {
+      if(params.diag_every > 0 && step % params.diag_every == 0) {
+        phase_tic = MPI_Wtime();
+        write_av_vel(av_fp, params, &av_request, av_step, &av_sum);
+        av_send = l_u_x[step-ii];
+        av_step = step;
+        MPI_Ireduce(&av_send, &av_sum, 1, MPI_FLOAT, MPI_SUM, MASTER, comm, &av_request);
+        phase_time[PHASE_REDUCE] += MPI_Wtime() - phase_tic;
+      }
+      if(params.checkpoint_every > 0 && (step+1) % params.checkpoint_every == 0) {
+        phase_tic = MPI_Wtime();
+        write_av_vel(av_fp, params, &av_request, av_step, &av_sum);
+        av_step = -1;
+        if(rank==MASTER) {
+          fflush(av_fp);
+          av_bytes = ftell(av_fp);
+        }
+        write_checkpoint(params, cells, step+1, av_bytes);
+        phase_time[PHASE_CHECKPOINT] += MPI_Wtime() - phase_tic;
+      }
+    }
 
+    /* the cells can only move between whole AA step pairs */
+    if(params.rebalance_every > 0 && (ii+nsteps) % params.rebalance_every == 0 && !cells->swapped) {
+      phase_tic = MPI_Wtime();
+      rebalance(&params, &cells, &tmp_cells, &obstacles,
+                busy - (phase_time[PHASE_HALO_WAIT] - waited));
+      busy = 0.0;
+      waited = phase_time[PHASE_HALO_WAIT];
+      phase_time[PHASE_REBALANCE] += MPI_Wtime() - phase_tic;
+    }
+  }
+  phase_tic = MPI_Wtime();
+  write_av_vel(av_fp, params, &av_request, av_step, &av_sum);
+  if(rank==MASTER) fclose(av_fp);
+  free(l_u_x);
+  phase_time[PHASE_REDUCE] += MPI_Wtime() - phase_tic;
 
+  gettimeofday(&timstr,NULL);
+  toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+  getrusage(RUSAGE_SELF, &ru);
+  timstr=ru.ru_utime;
+  usrtim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
+  timstr=ru.ru_stime;
+  systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
 
+  /* write final values and free memory */
+  phase_tic = MPI_Wtime();
+  reynolds = calc_reynolds(params,cells,obstacles);
+  if(rank==MASTER){
+    printf("==done==\n");
+    printf("Reynolds number:\t\t%.12E\n",reynolds);
+    printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
+    printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+    printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+  }
+  write_values(params,cells,obstacles);
+  phase_time[PHASE_OUTPUT] += MPI_Wtime() - phase_tic;
+  if(params.timing) write_timings(params, toc-tic, params.maxIters - first);
+  finalise(&params, &cells, &tmp_cells, &obstacles);
 
-float tot_u_x=0; 
-  int    tot_cells = 0; 
+  MPI_Finalize();
 
+  return EXIT_SUCCESS;
+}
 
-  MPI_Init(&argc, &argv);
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
-int start=0, end=0, ff, hh, gg;
-  params.rest = params.ny%nprocs;
-  for (ii=0;ii<params.maxIters;ii++) {
-    timestep(params,cells,tmp_cells,obstacles);
+float timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles)
+{
+  t_speed swap;  /* for exchanging the planes of the two grids */
+  float u_x;     /* sum of the x velocities of the fluid cells */
+  const int last = params.local_ny;       /* last owned row */
+  const int last_col = params.local_nx;   /* last owned column */
+  /* the owned cells next to the halos: the first and last rows,
+  ** then the first and last columns in between.  A strip is empty
+  ** when the block is too thin for it */
+  const int frame[4][4] = {
+    { 1, 1, 1, last_col },
+    { (last > 1) ? last : 2, last, 1, last_col },
+    { 2, last-1, 1, 1 },
+    { 2, last-1, (last_col > 1) ? last_col : 2, last_col }
+  };
+  int bb;        /* strip counter */
+
+  /* the owned cells are accelerated before they go out, so the
+  ** halo copies arrive accelerated and nothing touches a cell
+  ** while it is being sent */
+  accelerate_flow(params,cells,obstacles,1,last,1,last_col);
+
+  if(params.kernel == KERNEL_SPLIT) {
+    halo_start(params,cells,&halo);
+    halo_finish(params,cells,&halo);
+    propagate(params,cells,tmp_cells, obstacles);
+    rebound(cells,tmp_cells);
+    return collision(params,cells,tmp_cells,obstacles);
+  }
 
-    if(ii==1){
-      atyt = 0;
-    }
-      if(ii==2){
-      atyt = 1;
-    }
-   
+  if(params.kernel == KERNEL_AA && cells->swapped) {
+    /* odd step: purely local once the densities in the halos are back */
+    halo_start(params,cells,&halo_ret);
+    u_x = aa_odd(params,cells,obstacles,2,last-1,2,last_col-1);
+    halo_finish(params,cells,&halo_ret);
+    for(bb=0;bb<4;bb++)
+      u_x += aa_odd(params,cells,obstacles,frame[bb][0],frame[bb][1],frame[bb][2],frame[bb][3]);
+    cells->swapped = FALSE;
+    return u_x;
+  }
 
+  halo_start(params,cells,&halo);
 
+  if(params.kernel == KERNEL_SPARSE) {
+    u_x = sparse_collide(params,cells,tmp_cells,0,sparse.ninner);
+    halo_finish(params,cells,&halo);
+    u_x += sparse_collide(params,cells,tmp_cells,sparse.ninner,sparse.nfluid);
+    swap = *cells;
+    *cells = *tmp_cells;
+    *tmp_cells = swap;
+    return u_x;
+  }
 
-tot_u_x=0; 
-tot_cells = 0; 
+  if(params.kernel == KERNEL_AA) {
+    /* even step: a single grid, updated in place */
+    u_x = aa_even(params,cells,obstacles,2,last-1,2,last_col-1);
+    halo_finish(params,cells,&halo);
+    for(bb=0;bb<4;bb++)
+      u_x += aa_even(params,cells,obstacles,frame[bb][0],frame[bb][1],frame[bb][2],frame[bb][3]);
+    cells->swapped = TRUE;
+    return u_x;
+  }
 
- 
+  /* one sweep into the scratch grid, which then becomes the main grid */
+  u_x = stream_collide(params,cells,tmp_cells,obstacles,2,last-1,2,last_col-1);
+  halo_finish(params,cells,&halo);
+  for(bb=0;bb<4;bb++)
+    u_x += stream_collide(params,cells,tmp_cells,obstacles,frame[bb][0],frame[bb][1],frame[bb][2],frame[bb][3]);
+  swap = *cells;
+  *cells = *tmp_cells;
+  *tmp_cells = swap;
+  return u_x;
+}
 
-///////////av_velocity.................................................
-    int    jj,kk, tt, source;
-    float local_density=0;
-    float l_tot_u_x=0; 
-    int    l_tot_cells = 0; 
+int accelerate_flow(const t_param params, t_speed* cells, unsigned char* obstacles,
+                    int first, int last, int first_col, int last_col)
+{
+  int ii,jj;     /* generic counters */
+  float w1,w2;  /* weighting factors */
+  const double tic = MPI_Wtime();  /* start of the phase */
 
+  /* compute weighting factors */
+  w1 = params.density * params.accel / 9.0;
+  w2 = params.density * params.accel / 36.0;
 
- if(params.rest!=0){
-    if(rank>=params.rest){
-      start = params.rest*(params.ny/nprocs+1) + (rank-params.rest)*(params.ny/nprocs);
-      end= start+params.ny/nprocs-1;
-    }
-    else{
-      start = rank*(params.ny/nprocs+1);
-      end = start+params.ny/nprocs;
+  /* the flow is pushed east along the first column of the grid.
+  ** Among the owned cells only the ranks on its west edge hold it,
+  ** but a time block also accelerates the copies in its halos.
+  ** In the swapped layout some of what the owned cells hold sits
+  ** in the halos, which is sent back to the owners afterwards */
+  jj = first_col + ((1 - params.start_x - first_col) % params.nx + params.nx) % params.nx;
+  for(;jj<=last_col;jj+=params.nx) {
+    for(ii=first;ii<=last;ii++) {
+      if( !obstacles[ii*params.width + jj] &&
+    (*speed(params.width,cells,ii,jj,3) - w1) > 0.0 &&
+    (*speed(params.width,cells,ii,jj,6) - w2) > 0.0 &&
+    (*speed(params.width,cells,ii,jj,7) - w2) > 0.0 ) {
+        /* increase 'east-side' densities */
+        *speed(params.width,cells,ii,jj,1) += w1;
+        *speed(params.width,cells,ii,jj,5) += w2;
+        *speed(params.width,cells,ii,jj,8) += w2;
+        /* decrease 'west-side' densities */
+        *speed(params.width,cells,ii,jj,3) -= w1;
+        *speed(params.width,cells,ii,jj,6) -= w2;
+        *speed(params.width,cells,ii,jj,7) -= w2;
+      }
     }
-   }
-
-    for(kk=start;kk<=end;kk++)
-    
-      {
-        for(jj=0;jj<params.nx;jj++)
-        {
-                  if(!obstacles[kk*params.nx + jj])
-                  {
-                    local_density= 0.0;
-                    for(tt=0;tt<NSPEEDS;tt++)
-                    {
-                      local_density += cells[kk*params.nx + jj].speeds[tt];
-                    }
-          
-                    l_tot_u_x += (cells[kk*params.nx + jj].speeds[1] + 
-                        cells[kk*params.nx + jj].speeds[5] + 
-                        cells[kk*params.nx + jj].speeds[8]
-                        - (cells[kk*params.nx + jj].speeds[3] + 
-                           cells[kk*params.nx + jj].speeds[6] + 
-                           cells[kk*params.nx + jj].speeds[7])) / 
-                    local_density;
-
-                    l_tot_cells+=1;
-                  }
+  }
 
-        }
-      }
+  phase_time[PHASE_ACCELERATE] += MPI_Wtime() - tic;
 
+  return EXIT_SUCCESS;
+}
 
-    if(rank!=MASTER){
-      MPI_Send(&l_tot_u_x, 1, MPI_FLOAT, dest, tag, MPI_COMM_WORLD);
-      MPI_Send(&l_tot_cells, 1, MPI_INT, dest, tag, MPI_COMM_WORLD);}
-    else{
-      tot_cells = l_tot_cells;
-      tot_u_x = l_tot_u_x;
-      for (source =1; source < nprocs; source++) {
-        MPI_Recv(&l_tot_u_x, 1, MPI_FLOAT, source, tag, MPI_COMM_WORLD, &status);
-        tot_u_x+=l_tot_u_x;
-        MPI_Recv(&l_tot_cells, 1, MPI_INT, source, tag, MPI_COMM_WORLD, &status);
-        tot_cells+=l_tot_cells;
-      }
-      av_vels[ii] = tot_u_x / (float)tot_cells;
+/* the datatype for what crosses the side of the block in direction
+** dd: the speeds heading that way (sign 1) or coming from it (sign
+** -1), held in the owned cells along that side or in the halo cells
+** beyond it.  Each speed only covers the cells whose partner across
+** the side is owned by the receiver, so that no two messages write
+** the same slot.  For aa_return the densities sit under their
+** opposite speed, on the far side of the cell they came from */
+static MPI_Datatype side_type(const t_param params, t_speed* cells, int dd,
+                              int halo_cells, int sign, int aa_return)
+{
+  MPI_Datatype type;                /* the result */
+  MPI_Datatype blocks[NSPEEDS];     /* one box of cells per speed */
+  MPI_Aint displs[NSPEEDS];         /* where each box starts */
+  int lengths[NSPEEDS];
+  int nblocks = 0;
+  const int shift = aa_return ? 1 : -1;   /* partner is at -shift*c_k */
+  int first,last,first_col,last_col;      /* the box */
+  int kk;
+
+  for(kk=1;kk<NSPEEDS;kk++) {
+    if(cx[dd] && cx[kk] != sign*cx[dd]) continue;
+    if(cy[dd] && cy[kk] != sign*cy[dd]) continue;
+
+    /* across the side, one row or column; along it, the owned range
+    ** less the cells whose partner falls outside it */
+    if(cy[dd] == 1) first = last = halo_cells ? params.local_ny+1 : params.local_ny;
+    else if(cy[dd] == -1) first = last = halo_cells ? 0 : 1;
+    else {
+      first = (shift*cy[kk] > 0) ? 1 + shift*cy[kk] : 1;
+      last = (shift*cy[kk] < 0) ? params.local_ny + shift*cy[kk] : params.local_ny;
+    }
+    if(cx[dd] == 1) first_col = last_col = halo_cells ? params.local_nx+1 : params.local_nx;
+    else if(cx[dd] == -1) first_col = last_col = halo_cells ? 0 : 1;
+    else {
+      first_col = (shift*cx[kk] > 0) ? 1 + shift*cx[kk] : 1;
+      last_col = (shift*cx[kk] < 0) ? params.local_nx + shift*cx[kk] : params.local_nx;
     }
+    if(first > last || first_col > last_col) continue;
 
+    MPI_Type_vector(last-first+1, last_col-first_col+1, params.width, MPI_FLOAT, &blocks[nblocks]);
+    displs[nblocks] = (char*)&cells->speeds[aa_return ? opposite[kk] : kk][first*params.width + first_col]
+                    - (char*)cells->speeds[0];
+    lengths[nblocks] = 1;
+    nblocks++;
+  }
 
+  MPI_Type_create_struct(nblocks, lengths, displs, blocks, &type);
+  MPI_Type_commit(&type);
+  for(kk=0;kk<nblocks;kk++) MPI_Type_free(&blocks[kk]);
 
+  return type;
+}
 
+/* as side_type() for a sparse lattice: the fluid cells along the
+** whole side, or in the corner, listed in the same order by both
+** ends.  The strips along the sides stop short of the corners, so
+** no two messages write the same slot */
+static MPI_Datatype sparse_side_type(const t_param params, t_speed* cells, int dd,
+                                     int halo_cells, int sign)
+{
+  MPI_Datatype type;                /* the result */
+  MPI_Datatype blocks[NSPEEDS];     /* the cells of each speed */
+  MPI_Aint displs[NSPEEDS];         /* where each plane starts */
+  int lengths[NSPEEDS];
+  int nblocks = 0;
+  int* slots;                       /* of the cells */
+  int n = 0;                        /* no. of them */
+  int first,last,first_col,last_col;      /* the strip */
+  int ii,jj,kk;
+
+  if(cy[dd] == 1) first = last = halo_cells ? params.local_ny+1 : params.local_ny;
+  else if(cy[dd] == -1) first = last = halo_cells ? 0 : 1;
+  else { first = 1; last = params.local_ny; }
+  if(cx[dd] == 1) first_col = last_col = halo_cells ? params.local_nx+1 : params.local_nx;
+  else if(cx[dd] == -1) first_col = last_col = halo_cells ? 0 : 1;
+  else { first_col = 1; last_col = params.local_nx; }
+
+  slots = (int*)malloc(sizeof(int)*(last-first+1)*(last_col-first_col+1));
+  if (slots == NULL)
+    die("cannot allocate memory for a halo",__LINE__,__FILE__);
+  for(ii=first;ii<=last;ii++) {
+    for(jj=first_col;jj<=last_col;jj++) {
+      if(sparse.index[ii*params.width + jj] != sparse.nslots)
+        slots[n++] = sparse.index[ii*params.width + jj];
     }
+  }
 
+  for(kk=1;kk<NSPEEDS;kk++) {
+    if(cx[dd] && cx[kk] != sign*cx[dd]) continue;
+    if(cy[dd] && cy[kk] != sign*cy[dd]) continue;
+    MPI_Type_create_indexed_block(n, 1, slots, MPI_FLOAT, &blocks[nblocks]);
+    displs[nblocks] = (char*)cells->speeds[kk] - (char*)cells->speeds[0];
+    lengths[nblocks] = 1;
+    nblocks++;
+  }
 
+  MPI_Type_create_struct(nblocks, lengths, displs, blocks, &type);
+  MPI_Type_commit(&type);
+  for(kk=0;kk<nblocks;kk++) MPI_Type_free(&blocks[kk]);
+  free(slots);
 
+  return type;
+}
 
+/* as side_type() for KERNEL_BLOCKED: every speed of the strip of
+** cells depth deep along side dd, either the owned ones or the halo
+** cells beyond them.  The halo cells are swept again by the next
+** time block, so they need all the speeds, not just those crossing */
+static MPI_Datatype deep_side_type(const t_param params, t_speed* cells, int dd, int halo_cells)
+{
+  MPI_Datatype type;                /* the result */
+  MPI_Datatype box;                 /* the strip of one plane */
+  MPI_Datatype blocks[NSPEEDS];     /* that strip in every plane */
+  MPI_Aint displs[NSPEEDS];         /* where each one starts */
+  int lengths[NSPEEDS];
+  int first,last,first_col,last_col;      /* the strip */
+  int kk;
+
+  if(cy[dd] == 1) first = halo_cells ? params.local_ny+1 : params.local_ny-params.depth+1;
+  else if(cy[dd] == -1) first = halo_cells ? 1-params.depth : 1;
+  else first = 1;
+  last = cy[dd] ? first + params.depth - 1 : params.local_ny;
+  if(cx[dd] == 1) first_col = halo_cells ? params.local_nx+1 : params.local_nx-params.depth+1;
+  else if(cx[dd] == -1) first_col = halo_cells ? 1-params.depth : 1;
+  else first_col = 1;
+  last_col = cx[dd] ? first_col + params.depth - 1 : params.local_nx;
+
+  MPI_Type_vector(last-first+1, last_col-first_col+1, params.width, MPI_FLOAT, &box);
+  for(kk=0;kk<NSPEEDS;kk++) {
+    blocks[kk] = box;
+    displs[kk] = (char*)&cells->speeds[kk][first*params.width + first_col]
+               - (char*)cells->speeds[0];
+    lengths[kk] = 1;
+  }
 
+  MPI_Type_create_struct(NSPEEDS, lengths, displs, blocks, &type);
+  MPI_Type_commit(&type);
+  MPI_Type_free(&box);
 
+  return type;
+}
 
+void halo_init(const t_param params, t_halo* halo, t_speed* cells)
+{
+  int dd;   /* direction counter */
+
+  /* relative to speeds[0], so the types suit either grid; forward
+  ** exchanges go from the owned edge cells to the halos and the AA
+  ** return the other way round */
+  for(dd=1;dd<NSPEEDS;dd++) {
+    if(cells->index) {
+      halo->send[dd] = sparse_side_type(params, cells, dd, FALSE, 1);
+      halo->recv[dd] = sparse_side_type(params, cells, dd, TRUE, -1);
+      continue;
+    }
+    if(params.kernel == KERNEL_BLOCKED) {
+      halo->send[dd] = deep_side_type(params, cells, dd, FALSE);
+      halo->recv[dd] = deep_side_type(params, cells, dd, TRUE);
+      continue;
+    }
+    halo->send[dd] = side_type(params, cells, dd, halo->aa_return, 1, halo->aa_return);
+    halo->recv[dd] = side_type(params, cells, dd, !halo->aa_return, -1, halo->aa_return);
+  }
+}
 
+void halo_free(t_halo* halo)
+{
+  int dd;   /* direction counter */
 
+  for(dd=1;dd<NSPEEDS;dd++) {
+    MPI_Type_free(&halo->send[dd]);
+    MPI_Type_free(&halo->recv[dd]);
+  }
+}
 
+int halo_start(const t_param params, t_speed* cells, t_halo* halo)
+{
+  int dd;   /* direction counter */
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* straight out of and into the lattice, no packing.  Messages are
+  ** tagged with the direction they travel in, which keeps them apart
+  ** when several neighbours are the same rank */
+  for(dd=1;dd<NSPEEDS;dd++) {
+    MPI_Irecv(cells->speeds[0], 1, halo->recv[dd], neighbour[dd],
+              halo->tag+opposite[dd], comm, &halo->requests[dd-1]);
+  }
+  for(dd=1;dd<NSPEEDS;dd++) {
+    MPI_Isend(cells->speeds[0], 1, halo->send[dd], neighbour[dd],
+              halo->tag+dd, comm, &halo->requests[NSPEEDS-2+dd]);
+  }
 
+  phase_time[PHASE_HALO_POST] += MPI_Wtime() - tic;
 
+  return EXIT_SUCCESS;
+}
 
+int halo_finish(const t_param params, t_speed* cells, t_halo* halo)
+{
+  MPI_Status statuses[2*(NSPEEDS-1)];
+  const double tic = MPI_Wtime();  /* start of the phase */
 
+  MPI_Waitall(2*(NSPEEDS-1), halo->requests, statuses);
+  phase_time[PHASE_HALO_WAIT] += MPI_Wtime() - tic;
 
+  return EXIT_SUCCESS;
+}
 
+int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles)
+{
+  int ii,jj,kk;         /* generic counters */
+  int idx;              /* local index of the cell */
+  int offset[NSPEEDS];  /* from each cell to where its speed kk comes from */
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* the halo cells take care of the periodic wrap in both
+  ** directions, so every owned cell can simply collect the
+  ** densities travelling into it from its neighbours */
+  for(kk=0;kk<NSPEEDS;kk++) offset[kk] = -cy[kk]*params.width - cx[kk];
+
+  #pragma omp parallel for private(jj,kk,idx) schedule(static)
+  for(ii=1;ii<=params.local_ny;ii++) {
+    for(jj=1;jj<=params.local_nx;jj++) {
+      idx = ii*params.width + jj;
+      /* propagate densities to neighbouring cells, following
+      ** appropriate directions of travel and writing into
+      ** scratch space grid */
+      for(kk=0;kk<NSPEEDS;kk++) {
+        tmp_cells->speeds[kk][idx] = cells->speeds[kk][idx + offset[kk]];
+      }
+    }
+  }
 
+  phase_time[PHASE_PROPAGATE] += MPI_Wtime() - tic;
 
+  return EXIT_SUCCESS;
+}
 
+int rebound(t_speed* cells, t_speed* tmp_cells)
+{
+  int ii,kk;  /* generic counters */
+  int idx;    /* local index of the cell */
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* only the obstacle cells listed by boundary_init(), one speed
+  ** at a time.  The threads share each list, all in the one parallel
+  ** region: each speed writes a plane of its own, so none of them
+  ** waits for the others to finish the previous list */
+  #pragma omp parallel private(ii,kk,idx)
+  for(kk=1;kk<NSPEEDS;kk++) {
+    const int* list = boundary.cells[kk];
+    float* dst = cells->speeds[kk];
+    const float* src = tmp_cells->speeds[opposite[kk]];
+    #pragma omp for nowait schedule(static)
+    for(ii=0;ii<boundary.count[kk];ii++) {
+      idx = list[ii];
+      /* called after propagate, so taking values from scratch space
+      ** mirroring, and writing into main grid */
+      dst[idx] = src[idx];
+    }
+  }
 
+  phase_time[PHASE_REBOUND] += MPI_Wtime() - tic;
 
+  return EXIT_SUCCESS;
+}
 
+/* relax the densities s of a single cell towards equilibrium,
+** writing the result into d and returning the x velocity, which
+** the relaxation conserves; the scalar twin of relax_vec() */
+static inline float relax(const float omega, const float* s, float* d)
+{
+  const float w0 = 0.4444444444;    /* weighting factor */
+  const float w1 = 0.1111111111;    /* weighting factor */
+  const float w2 = 0.0277777777;   /* weighting factor */
+  float u_x,u_y;               /* av. velocities in x and y directions */
+  float u_sq;                  /* squared velocity */
+  float local_density;         /* sum of densities in a particular cell */
 
+  /* compute local density total */
+  local_density = s[0]+s[1]+s[2]+s[3]+s[4]+s[5]+s[6]+s[7]+s[8];
+  /* compute x velocity component */
+  u_x = (s[1]+s[5]+s[8] - (s[3]+s[6]+s[7]))/local_density;
+  /* compute y velocity component */
+  u_y = (s[2]+s[5]+s[6] - (s[4]+s[7]+s[8]))/local_density;
+  /* velocity squared */
+  u_sq = (u_x*u_x + u_y*u_y)*1.5f;
+
+  d[0] = s[0]+omega*((w0*local_density*(1.0f - u_sq)) - s[0]);
+  d[1] = s[1]+omega*((w1*local_density*(1.0f + u_x*3.0f + (u_x*u_x)*4.5f - u_sq)) - s[1]);
+  d[2] = s[2]+omega*((w1*local_density*(1.0f + u_y*3.0f + (u_y*u_y)*4.5f - u_sq)) - s[2]);
+  d[3] = s[3]+omega*((w1*local_density*(1.0f - u_x*3.0f + (u_x*u_x)*4.5f - u_sq)) - s[3]);
+  d[4] = s[4]+omega*((w1*local_density*(1.0f - u_y*3.0f + (u_y*u_y)*4.5f - u_sq)) - s[4]);
+  d[5] = s[5]+omega*((w2*local_density*(1.0f + (u_x+u_y)*3.0f + ((u_x+u_y)*(u_x+u_y))*4.5f - u_sq)) - s[5]);
+  d[6] = s[6]+omega*((w2*local_density*(1.0f + (u_y-u_x)*3.0f + ((u_y-u_x)*(u_y-u_x))*4.5f - u_sq)) - s[6]);
+  d[7] = s[7]+omega*((w2*local_density*(1.0f + (-u_y-u_x)*3.0f + ((-u_y-u_x)*(-u_y-u_x))*4.5f - u_sq)) - s[7]);
+  d[8] = s[8]+omega*((w2*local_density*(1.0f + (u_x-u_y)*3.0f + ((u_x-u_y)*(u_x-u_y))*4.5f - u_sq)) - s[8]);
+
+  return u_x;
+}
 
+/* mirror the densities s of an obstacle cell into d */
+static inline void reflect(const float* s, float* d)
+{
+  d[0] = s[0];
+  d[1] = s[3];
+  d[2] = s[4];
+  d[3] = s[1];
+  d[4] = s[2];
+  d[5] = s[7];
+  d[6] = s[8];
+  d[7] = s[5];
+  d[8] = s[6];
+}
 
+#if VLEN > 1
+/* relax VLEN cells at once, with the terms grouped as in relax().
+** The results only match relax() up to rounding: the compiler is
+** free to contract the multiplies and adds of either one into FMAs,
+** and does so differently, so SIMD and scalar builds drift apart in
+** the last bits (of order 1e-5 relative in av_vels over a run) */
+static inline t_vec relax_vec(const t_vec omega, const t_vec* s, t_vec* d)
+{
+  const t_vec w0 = vset1(0.4444444444);    /* weighting factor */
+  const t_vec w1 = vset1(0.1111111111);    /* weighting factor */
+  const t_vec w2 = vset1(0.0277777777);   /* weighting factor */
+  const t_vec zero = vset1(0.0f);
+  const t_vec one = vset1(1.0f);
+  const t_vec three = vset1(3.0f);
+  const t_vec four_half = vset1(4.5f);
+  const t_vec one_half = vset1(1.5f);
+  t_vec u_x,u_y,u;             /* velocities */
+  t_vec u_sq;                  /* squared velocity */
+  t_vec local_density;         /* sum of densities in each cell */
+
+  local_density = vadd(vadd(vadd(vadd(vadd(vadd(vadd(vadd(s[0],s[1]),s[2]),s[3]),s[4]),s[5]),s[6]),s[7]),s[8]);
+  u_x = vdiv(vsub(vadd(vadd(s[1],s[5]),s[8]), vadd(vadd(s[3],s[6]),s[7])), local_density);
+  u_y = vdiv(vsub(vadd(vadd(s[2],s[5]),s[6]), vadd(vadd(s[4],s[7]),s[8])), local_density);
+  u_sq = vmul(vadd(vmul(u_x,u_x), vmul(u_y,u_y)), one_half);
+
+/* relax speed k whose velocity projection is u_k, weighted by w_k */
+#define RELAX(k,w_k,u_k) \
+  u = (u_k); \
+  d[k] = vadd(s[k], vmul(omega, vsub(vmul(vmul(w_k,local_density), vsub(vadd(vadd(one, vmul(u,three)), vmul(vmul(u,u),four_half)), u_sq)), s[k])));
+
+  d[0] = vadd(s[0], vmul(omega, vsub(vmul(vmul(w0,local_density), vsub(one,u_sq)), s[0])));
+  RELAX(1, w1, u_x)
+  RELAX(2, w1, u_y)
+  RELAX(3, w1, vsub(zero,u_x))
+  RELAX(4, w1, vsub(zero,u_y))
+  RELAX(5, w2, vadd(u_x,u_y))
+  RELAX(6, w2, vsub(u_y,u_x))
+  RELAX(7, w2, vsub(vsub(zero,u_y),u_x))
+  RELAX(8, w2, vsub(u_x,u_y))
+#undef RELAX
+
+  return u_x;
+}
+#endif
 
- 
-  float mes[9*params.nx];
-  float mes2[9*params.nx];
- 
- int xx, kk, jj;
-
-      if(params.rest!=0){
-    if(rank>=params.rest){
-      start = params.rest*(params.ny/nprocs+1) + (rank-params.rest)*(params.ny/nprocs);
-      end= start+params.ny/nprocs-1;
-    }
-    else{
-      start = rank*(params.ny/nprocs+1);
-      end = start+params.ny/nprocs;
-    }
-   }
-
-  for(xx=0;xx<params.ny;xx++){
-    if(rank!=master){
-      if(xx>=start&&xx<=end){
-        for(jj=0;jj<params.nx;jj++) {
-           for(kk=0;kk<NSPEEDS;kk++) {
-             cell_c[jj*NSPEEDS+kk]=cells[ii*params.nx+jj].speeds[kk];
-            }
-         }  
-         MPI_Send(cell_c, NSPEEDS*params.nx, MPI_FLOAT,0, 0, MPI_COMM_WORLD);
+float collision(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles)
+{
+  int ii,jj,kk;              /* generic counters */
+  int idx;                   /* local index of the cell */
+  float s[NSPEEDS];          /* incoming densities */
+  float d[NSPEEDS];          /* relaxed densities */
+  float u_x = 0.0f;          /* sum of the x velocities of the fluid cells */
+#if VLEN > 1
+  const t_vec omega = vset1(params.omega);
+  const t_vec zero = vset1(0.0f);
+#endif
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* loop over the owned cells in the grid
+  ** NB the collision step is called after
+  ** the propagate step and so values of interest
+  ** are in the scratch-space grid.
+  ** Rows are processed VLEN cells at a time; obstacle cells
+  ** are relaxed too but blended back to what rebound() wrote,
+  ** so there is no branch in the vector loop */
+  #pragma omp parallel for private(jj,kk,idx,s,d) reduction(+:u_x) schedule(static)
+  for(ii=1;ii<=params.local_ny;ii++) {
+#if VLEN > 1
+    t_vec row_u_x = zero;      /* velocities of this row's vector lanes */
+#endif
+    jj=1;
+#if VLEN > 1
+    for(;jj+VLEN-1<=params.local_nx;jj+=VLEN) {
+      t_vec vs[NSPEEDS];         /* incoming densities */
+      t_vec vd[NSPEEDS];         /* relaxed densities */
+      t_vec vu_x;                /* and their x velocities */
+      t_mask blocked;            /* lanes holding obstacles */
+
+      idx = ii*params.width + jj;
+      for(kk=0;kk<NSPEEDS;kk++) vs[kk] = vload(&tmp_cells->speeds[kk][idx]);
+      vu_x = relax_vec(omega, vs, vd);
+      blocked = vmask(&obstacles[idx]);
+      for(kk=0;kk<NSPEEDS;kk++) {
+        vstore(&cells->speeds[kk][idx], vblend(blocked, vd[kk], vload(&cells->speeds[kk][idx])));
       }
+      row_u_x = vadd(row_u_x, vblend(blocked, vu_x, zero));
     }
-
-    if(rank==master){
-      for(source=1;source<nprocs;source++){
-        if(params.rest!=0){
-          if(source>=params.rest){
-            start = params.rest*(params.ny/nprocs+1) + (source-params.rest)*(params.ny/nprocs);
-            end= start+params.ny/nprocs-1;
-          }
-          else{
-            start = source*(params.ny/nprocs+1);
-            end = start+params.ny/nprocs;
-          }
-        }
-        if(ii>=start&&ii<+end)
-        MPI_Recv(mes2, NSPEEDS*params.nx, MPI_FLOAT, source, tag, MPI_COMM_WORLD, &status);
-          for(hh=0;hh<params.nx;hh++){
-            for(ff=0;ff<NSPEEDS;ff++){
-              cells[gg*params.nx + hh].speeds[ff]=mes2[NSPEEDS*hh+ff];
-            }
-          }
-        }     
+    u_x += vhadd(row_u_x);
+#endif
+    for(;jj<=params.local_nx;jj++) {
+      idx = ii*params.width + jj;
+      /* don't consider occupied cells */
+      if(!obstacles[idx]) {
+        for(kk=0;kk<NSPEEDS;kk++) s[kk] = tmp_cells->speeds[kk][idx];
+        u_x += relax(params.omega, s, d);
+        for(kk=0;kk<NSPEEDS;kk++) cells->speeds[kk][idx] = d[kk];
       }
     }
   }
-  
-  ///////////av_velocity.................................................
-
-  MPI_Finalize();
 
+  phase_time[PHASE_COLLIDE] += MPI_Wtime() - tic;
 
-
-
-  gettimeofday(&timstr,NULL);
-  toc=timstr.tv_sec+(timstr.tv_usec/1000000.0);
-  getrusage(RUSAGE_SELF, &ru);
-  timstr=ru.ru_utime;        
-  usrtim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
-  timstr=ru.ru_stime;        
-  systim=timstr.tv_sec+(timstr.tv_usec/1000000.0);
-
-  if(rank==0){
-  /* write final values and free memory */
-  printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n",calc_reynolds(params,cells,obstacles));
-  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc-tic);
-  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
-  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-  write_values(params,cells,obstacles,av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
-  //openFile(); // OPEN THE MULTIPLE OUTPUT FILE
-  //printf("\n\n%f\n", toc-tic);
-  //printF(toc-tic);
- // fclose(ofp);
-}
-  return EXIT_SUCCESS;
+  return u_x;
 }
 
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+/* pull the densities arriving at cell (ii,jj) and write the
+** rebounded or relaxed result into the scratch grid, returning the
+** x velocity of a fluid cell */
+static inline float stream_collide_cell(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                       unsigned char* obstacles, int ii, int jj)
 {
-  //accelerate_flow(params,cells,obstacles);
-  propagate(params,cells,tmp_cells, obstacles);
-  rebound(params,cells,tmp_cells,obstacles);
-  collision(params,cells,tmp_cells,obstacles);
-  return EXIT_SUCCESS; 
+  const int y_n = ii + 1;   /* the halo cells take care of the wrap */
+  const int y_s = ii - 1;
+  const int x_e = jj + 1;
+  const int x_w = jj - 1;
+  float s[NSPEEDS];         /* incoming densities */
+  float d[NSPEEDS];         /* outgoing densities */
+  float u_x = 0.0f;         /* x velocity, none for an obstacle */
+  int kk;
+
+  s[0] = cells->speeds[0][ii *params.width + jj];  /* central cell, no movement */
+  s[1] = cells->speeds[1][ii *params.width + x_w]; /* from the west */
+  s[2] = cells->speeds[2][y_s*params.width + jj];  /* from the south */
+  s[3] = cells->speeds[3][ii *params.width + x_e]; /* from the east */
+  s[4] = cells->speeds[4][y_n*params.width + jj];  /* from the north */
+  s[5] = cells->speeds[5][y_s*params.width + x_w]; /* from the south-west */
+  s[6] = cells->speeds[6][y_s*params.width + x_e]; /* from the south-east */
+  s[7] = cells->speeds[7][y_n*params.width + x_e]; /* from the north-east */
+  s[8] = cells->speeds[8][y_n*params.width + x_w]; /* from the north-west */
+
+  if(obstacles[ii*params.width + jj]) reflect(s, d);
+  else u_x = relax(params.omega, s, d);
+
+  for(kk=0;kk<NSPEEDS;kk++) tmp_cells->speeds[kk][ii*params.width + jj] = d[kk];
+
+  return u_x;
 }
 
-
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+float stream_collide(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles,
+                     int first, int last, int first_col, int last_col)
 {
+  int ii,jj;                 /* generic counters */
+  float u_x = 0.0f;          /* sum of the x velocities of the fluid cells */
+#if VLEN > 1
+  const int w = params.width;
+  const t_vec omega = vset1(params.omega);
+  const t_vec zero = vset1(0.0f);
+#endif
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* a pull scheme: every owned cell gathers the densities
+  ** streaming into it from its neighbours in cells (halo cells
+  ** included), then rebounds or relaxes them in registers and
+  ** writes the scratch grid once.
+  ** Only owned cells first..last by first_col..last_col are swept */
+  #pragma omp parallel for private(jj) reduction(+:u_x) schedule(static)
+  for(ii=first;ii<=last;ii++) {
+#if VLEN > 1
+    t_vec row_u_x = zero;      /* velocities of this row's vector lanes */
+#endif
+    jj=first_col;
+#if VLEN > 1
+    for(;jj+VLEN-1<=last_col;jj+=VLEN) {
+      int kk;                    /* speed counter */
+      const int idx = ii*w + jj; /* local index of the first cell */
+      t_vec s[NSPEEDS];          /* incoming densities */
+      t_vec d[NSPEEDS];          /* relaxed densities */
+      t_vec r[NSPEEDS];          /* rebounded densities */
+      t_vec vu_x;                /* x velocities */
+      t_mask blocked;            /* lanes holding obstacles */
+
+      s[0] = vload(&cells->speeds[0][idx]);
+      s[1] = vload(&cells->speeds[1][idx - 1]);
+      s[2] = vload(&cells->speeds[2][idx - w]);
+      s[3] = vload(&cells->speeds[3][idx + 1]);
+      s[4] = vload(&cells->speeds[4][idx + w]);
+      s[5] = vload(&cells->speeds[5][idx - w - 1]);
+      s[6] = vload(&cells->speeds[6][idx - w + 1]);
+      s[7] = vload(&cells->speeds[7][idx + w + 1]);
+      s[8] = vload(&cells->speeds[8][idx + w - 1]);
+
+      vu_x = relax_vec(omega, s, d);
+      r[0] = s[0]; r[1] = s[3]; r[2] = s[4]; r[3] = s[1]; r[4] = s[2];
+      r[5] = s[7]; r[6] = s[8]; r[7] = s[5]; r[8] = s[6];
+
+      blocked = vmask(&obstacles[idx]);
+      for(kk=0;kk<NSPEEDS;kk++) {
+        vstore(&tmp_cells->speeds[kk][idx], vblend(blocked, d[kk], r[kk]));
+      }
+      row_u_x = vadd(row_u_x, vblend(blocked, vu_x, zero));
+    }
+    u_x += vhadd(row_u_x);
+#endif
+    for(;jj<=last_col;jj++) {
+      u_x += stream_collide_cell(params, cells, tmp_cells, obstacles, ii, jj);
+    }
+  }
 
-  int ii,jj;            /* generic counters */
-  int x_e,x_w,y_n,y_s;  /* indices of neighbouring cells */
-  float w1,w2;  /* weighting factors */
-  
-  /* compute weighting factors */
-  w1 = params.density * params.accel / 9.0;
-  w2 = params.density * params.accel / 36.0;
-  
-  float halo_north[9*params.nx];
-  float halo_north_r[9*params.nx];
-  float halo_south[9*params.nx];
-  float halo_south_r[9*params.nx];
-
-
-    
-
+  phase_time[PHASE_COLLIDE] += MPI_Wtime() - tic;
 
+  return u_x;
+}
 
+/* stream_collide() over rows first..last by columns first_col..last_col
+** of a time block, which may reach into the halos, returning the sum
+** of the x velocities of the owned cells among them only */
+static float block_sweep(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles,
+                         int first, int last, int first_col, int last_col)
+{
+  const int lo = (first > 1) ? first : 1;                            /* owned rows */
+  const int hi = (last < params.local_ny) ? last : params.local_ny;
 
-      int hh, ff;
-      int rank_right = (rank + 1) % nprocs;
-      int rank_left = rank-1;
-      if(rank_left<0)
-        rank_left = nprocs-1;
-      int h_south;
-      int h_north;
+  if(lo > hi) {
+    stream_collide(params,cells,tmp_cells,obstacles,first,last,first_col,last_col);
+    return 0.0f;
+  }
+  if(first < lo) stream_collide(params,cells,tmp_cells,obstacles,first,lo-1,first_col,last_col);
+  if(last > hi) stream_collide(params,cells,tmp_cells,obstacles,hi+1,last,first_col,last_col);
+  if(first_col < 1) stream_collide(params,cells,tmp_cells,obstacles,lo,hi,first_col,0);
+  if(last_col > params.local_nx)
+    stream_collide(params,cells,tmp_cells,obstacles,lo,hi,params.local_nx+1,last_col);
 
+  return stream_collide(params,cells,tmp_cells,obstacles,lo,hi,1,params.local_nx);
+}
 
+/* nsteps timesteps, no more than params.depth, with one halo exchange:
+** step ss sweeps the block and all but the outer ss cells of its halo
+** frame, which leaves exactly the owned cells for the last step.
+** Rather than the whole block at a time, the steps advance together
+** as a wavefront over tiles of rows, step ss a tile behind step ss-1,
+** so that each tile is read again while it is still in cache.  The
+** two grids alternate between the steps, and step ss+1 only writes
+** over the rows of step ss-1 that step ss has finished reading.
+** The sum of the x velocities of the owned cells after each step
+** goes in u_x[] */
+void time_block(const t_param params, t_speed* cells, t_speed* tmp_cells, unsigned char* obstacles,
+                int nsteps, float* u_x)
+{
+  t_speed* grid[2];        /* read by the odd steps, then by the even ones */
+  t_speed swap;            /* for exchanging the planes of the two grids */
+  int rows = TILE_ROWS;    /* rows per tile */
+  int front;               /* first row of the tile of the first step */
+  int first,last;          /* rows of the tile of step ss */
+  int frame;               /* halo cells step ss computes on each side */
+  int ss;                  /* step counter */
+
+#ifdef _OPENMP
+  if(rows < omp_get_max_threads()) rows = omp_get_max_threads();
+#endif
+
+  /* as timestep(): the halo copies arrive accelerated */
+  accelerate_flow(params,cells,obstacles,1,params.local_ny,1,params.local_nx);
+  halo_start(params,cells,&halo);
+  halo_finish(params,cells,&halo);
+
+  grid[0] = cells;
+  grid[1] = tmp_cells;
+  for(ss=0;ss<nsteps;ss++) u_x[ss] = 0.0f;
+
+  for(front=2-nsteps; front-(nsteps-1)*rows<=params.local_ny; front+=rows) {
+    for(ss=1;ss<=nsteps;ss++) {
+      frame = nsteps - ss;
+      first = front - (ss-1)*rows;
+      last = first + rows - 1;
+      if(first < 1-frame) first = 1-frame;
+      if(last > params.local_ny+frame) last = params.local_ny+frame;
+      if(first > last) continue;
+      u_x[ss-1] += block_sweep(params, grid[(ss-1)%2], grid[ss%2], obstacles,
+                               first, last, 1-frame, params.local_nx+frame);
+      /* the next step reads the tile accelerated, like a whole step */
+      if(ss < nsteps)
+        accelerate_flow(params, grid[ss%2], obstacles, first, last, 1-frame, params.local_nx+frame);
+    }
+  }
 
+  if(nsteps % 2) {
+    swap = *cells;
+    *cells = *tmp_cells;
+    *tmp_cells = swap;
+  }
+}
 
-   int start=0, end=0;
-   // if(rank<params.rest && params.rest!=0){
-   //    start = rank*(params.ny/nprocs)+rank%params.rest;
-   //    end = (rank+1)*(params.ny/nprocs) + (rank)%params.rest;
-   // }
-   // else if(params.rest!=0){
-   //  start= rank*(params.ny/nprocs)+params.rest-1;
-   //  end = (rank+1)*(params.ny/nprocs)+params.rest-1;
-   // }
+/* AA even step for cell (ii,jj): pull the arriving densities from
+** the neighbours and write the relaxed ones back over them, each
+** under its opposite speed, returning the x velocity.  Obstacles
+** would write back exactly what they read, so they are skipped */
+static inline float aa_even_cell(const t_param params, t_speed* cells, unsigned char* obstacles, int ii, int jj)
+{
+  const int y_n = ii + 1;   /* the halo cells take care of the wrap */
+  const int y_s = ii - 1;
+  const int x_e = jj + 1;
+  const int x_w = jj - 1;
+  float* slot[NSPEEDS];     /* where each arriving density is held */
+  float s[NSPEEDS];         /* incoming densities */
+  float d[NSPEEDS];         /* relaxed densities */
+  float u_x;                /* x velocity */
+  int kk;
+
+  if(obstacles[ii*params.width + jj]) return 0.0f;
+
+  slot[0] = &cells->speeds[0][ii *params.width + jj];
+  slot[1] = &cells->speeds[1][ii *params.width + x_w];
+  slot[2] = &cells->speeds[2][y_s*params.width + jj];
+  slot[3] = &cells->speeds[3][ii *params.width + x_e];
+  slot[4] = &cells->speeds[4][y_n*params.width + jj];
+  slot[5] = &cells->speeds[5][y_s*params.width + x_w];
+  slot[6] = &cells->speeds[6][y_s*params.width + x_e];
+  slot[7] = &cells->speeds[7][y_n*params.width + x_e];
+  slot[8] = &cells->speeds[8][y_n*params.width + x_w];
+
+  for(kk=0;kk<NSPEEDS;kk++) s[kk] = *slot[kk];
+  u_x = relax(params.omega, s, d);
+  for(kk=0;kk<NSPEEDS;kk++) *slot[opposite[kk]] = d[kk];
+
+  return u_x;
+}
 
-   if(params.rest!=0){
-    if(rank>=params.rest){
-      start = params.rest*(params.ny/nprocs+1) + (rank-params.rest)*(params.ny/nprocs);
-      end= start+params.ny/nprocs-1;
+float aa_even(const t_param params, t_speed* cells, unsigned char* obstacles,
+              int first, int last, int first_col, int last_col)
+{
+  int ii,jj;                 /* generic counters */
+  float u_x = 0.0f;          /* sum of the x velocities of the fluid cells */
+#if VLEN > 1
+  const int w = params.width;
+  const t_vec omega = vset1(params.omega);
+  const t_vec zero = vset1(0.0f);
+#endif
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* each cell reads and then overwrites the same nine slots, which
+  ** no other cell touches, so the sweep can run in place.  The
+  ** densities leaving the block end up in the halo cells, and the
+  ** rows can be shared between threads in any order.
+  ** Only owned cells first..last by first_col..last_col are swept */
+  #pragma omp parallel for private(jj) reduction(+:u_x) schedule(static)
+  for(ii=first;ii<=last;ii++) {
+#if VLEN > 1
+    t_vec row_u_x = zero;      /* velocities of this row's vector lanes */
+#endif
+    jj=first_col;
+#if VLEN > 1
+    for(;jj+VLEN-1<=last_col;jj+=VLEN) {
+      int kk;                    /* speed counter */
+      const int idx = ii*w + jj; /* local index of the first cell */
+      float* slot[NSPEEDS];      /* where the arriving densities are held */
+      t_vec s[NSPEEDS];          /* incoming densities */
+      t_vec d[NSPEEDS];          /* relaxed densities */
+      t_vec vu_x;                /* x velocities */
+      t_mask blocked;            /* lanes holding obstacles */
+
+      slot[0] = &cells->speeds[0][idx];
+      slot[1] = &cells->speeds[1][idx - 1];
+      slot[2] = &cells->speeds[2][idx - w];
+      slot[3] = &cells->speeds[3][idx + 1];
+      slot[4] = &cells->speeds[4][idx + w];
+      slot[5] = &cells->speeds[5][idx - w - 1];
+      slot[6] = &cells->speeds[6][idx - w + 1];
+      slot[7] = &cells->speeds[7][idx + w + 1];
+      slot[8] = &cells->speeds[8][idx + w - 1];
+
+      for(kk=0;kk<NSPEEDS;kk++) s[kk] = vload(slot[kk]);
+      vu_x = relax_vec(omega, s, d);
+
+      /* obstacle lanes keep what they read */
+      blocked = vmask(&obstacles[idx]);
+      for(kk=0;kk<NSPEEDS;kk++) {
+        vstore(slot[opposite[kk]], vblend(blocked, d[kk], s[opposite[kk]]));
+      }
+      row_u_x = vadd(row_u_x, vblend(blocked, vu_x, zero));
     }
-    else{
-      start = rank*(params.ny/nprocs+1);
-      end = start+params.ny/nprocs;
+    u_x += vhadd(row_u_x);
+#endif
+    for(;jj<=last_col;jj++) {
+      u_x += aa_even_cell(params, cells, obstacles, ii, jj);
     }
-   }
+  }
 
-      if(start==0){
-        h_south = params.ny-1;
-      }
-      else{
-        h_south = start-1;
-      }
+  phase_time[PHASE_COLLIDE] += MPI_Wtime() - tic;
 
-      if(end==params.ny-1){
-        h_north = 0;
+  return u_x;
+}
+
+float aa_odd(const t_param params, t_speed* cells, unsigned char* obstacles,
+             int first, int last, int first_col, int last_col)
+{
+  int ii,jj,kk;              /* generic counters */
+  int idx;                   /* local index of the cell */
+  float s[NSPEEDS];          /* incoming densities */
+  float d[NSPEEDS];          /* relaxed densities */
+  float u_x = 0.0f;          /* sum of the x velocities of the fluid cells */
+#if VLEN > 1
+  const t_vec omega = vset1(params.omega);
+  const t_vec zero = vset1(0.0f);
+#endif
+  const double tic = MPI_Wtime();  /* start of the phase */
+
+  /* after the even step every density arriving at a cell is
+  ** already held in that cell, under the opposite speed, so this
+  ** sweep is purely local and restores the natural layout.
+  ** Obstacles would again write back what they read.
+  ** Only owned cells first..last by first_col..last_col are swept */
+  #pragma omp parallel for private(jj,kk,idx,s,d) reduction(+:u_x) schedule(static)
+  for(ii=first;ii<=last;ii++) {
+#if VLEN > 1
+    t_vec row_u_x = zero;      /* velocities of this row's vector lanes */
+#endif
+    jj=first_col;
+#if VLEN > 1
+    for(;jj+VLEN-1<=last_col;jj+=VLEN) {
+      t_vec vs[NSPEEDS];         /* incoming densities */
+      t_vec vd[NSPEEDS];         /* relaxed densities */
+      t_vec vu_x;                /* and their x velocities */
+      t_mask blocked;            /* lanes holding obstacles */
+
+      idx = ii*params.width + jj;
+      for(kk=0;kk<NSPEEDS;kk++) vs[kk] = vload(&cells->speeds[opposite[kk]][idx]);
+      vu_x = relax_vec(omega, vs, vd);
+      blocked = vmask(&obstacles[idx]);
+      for(kk=0;kk<NSPEEDS;kk++) {
+        vstore(&cells->speeds[kk][idx], vblend(blocked, vd[kk], vs[opposite[kk]]));
       }
-      else{
-        h_north = end+1;
+      row_u_x = vadd(row_u_x, vblend(blocked, vu_x, zero));
+    }
+    u_x += vhadd(row_u_x);
+#endif
+    for(;jj<=last_col;jj++) {
+      idx = ii*params.width + jj;
+      if(!obstacles[idx]) {
+        for(kk=0;kk<NSPEEDS;kk++) s[kk] = cells->speeds[opposite[kk]][idx];
+        u_x += relax(params.omega, s, d);
+        for(kk=0;kk<NSPEEDS;kk++) cells->speeds[kk][idx] = d[kk];
       }
+    }
+  }
 
-      // if(atyt==0){
-      //   printf("r: %d, s: %d, e: %d, hs: %d, hn: %d\n", rank, start, end, h_south, h_north);
-      // }
-
+  phase_time[PHASE_COLLIDE] += MPI_Wtime() - tic;
 
+  return u_x;
+}
 
+/* the fused sweep of KERNEL_SPARSE over the owned fluid slots
+** first..last-1: each speed is pulled from the slot upstream or,
+** with an obstacle there, is what this cell sent the obstacle on
+** the step before, which the scratch grid still holds */
+float sparse_collide(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                     int first, int last)
+{
+  int ii,kk;                 /* generic counters */
+  int up;                    /* upstream slot */
+  float s[NSPEEDS];          /* incoming densities */
+  float d[NSPEEDS];          /* relaxed densities */
+  float u_x = 0.0f;          /* sum of the x velocities of the fluid cells */
+  const double tic = MPI_Wtime();  /* start of the phase */
+#if VLEN > 1
+  const t_vec omega = vset1(params.omega);
+  const int last_vec = first + (last-first)/VLEN*VLEN;   /* end of the whole vectors */
+
+  /* the slots are contiguous, so only the upstream cells are gathered */
+  #pragma omp parallel for private(kk) reduction(+:u_x) schedule(static)
+  for(ii=first;ii<last_vec;ii+=VLEN) {
+    t_vec vs[NSPEEDS];         /* incoming densities */
+    t_vec vd[NSPEEDS];         /* relaxed densities */
+    t_ivec vup;                /* upstream slots */
+
+    vs[0] = vload(&cells->speeds[0][ii]);
+    for(kk=1;kk<NSPEEDS;kk++) {
+      vup = vloadi(&sparse.upstream[kk][ii]);
+      vs[kk] = vpull(cells->speeds[kk], vup, vload(&tmp_cells->speeds[opposite[kk]][ii]));
+    }
+    u_x += vhadd(relax_vec(omega, vs, vd));
+    for(kk=0;kk<NSPEEDS;kk++) vstore(&tmp_cells->speeds[kk][ii], vd[kk]);
+  }
+  first = last_vec;
+#endif
+
+  #pragma omp parallel for private(kk,up,s,d) reduction(+:u_x) schedule(static)
+  for(ii=first;ii<last;ii++) {
+    s[0] = cells->speeds[0][ii];
+    for(kk=1;kk<NSPEEDS;kk++) {
+      up = sparse.upstream[kk][ii];
+      s[kk] = (up >= 0) ? cells->speeds[kk][up] : tmp_cells->speeds[opposite[kk]][ii];
+    }
+    u_x += relax(params.omega, s, d);
+    for(kk=0;kk<NSPEEDS;kk++) tmp_cells->speeds[kk][ii] = d[kk];
+  }
 
-      int kk;
+  phase_time[PHASE_COLLIDE] += MPI_Wtime() - tic;
 
-        //copy last row into south_halo
-        for(hh=0;hh<params.nx;hh++){
-            for(ff=0;ff<9;ff++){
-              halo_south[9*hh+ff] = cells[(end)*params.nx + hh].speeds[ff];
-            }
-          }
+  return u_x;
+}
 
-        //send south halo to the right and receive it into north halo from the left
-        MPI_Sendrecv(halo_south, 9*params.nx, MPI_FLOAT, rank_right, tag, halo_south_r, 9*params.nx, MPI_FLOAT, rank_left, tag, MPI_COMM_WORLD, &status);
-        //printf("\n\nSpeed: %f\n", halo_north[0]);
+void cut_axis(int n, int nparts, const int* weight, int minimum, int* cut)
+{
+  const int base = n / nparts;   /* cells every part gets */
+  const int rest = n % nparts;   /* no. of parts holding one extra */
+  long total = 0;                /* weight of the whole axis */
+  long sum = 0;                  /* and of the cells before ii */
+  int ii = 0;                    /* first cell not yet in a part */
+  int p;                         /* part counter */
+
+  if(weight != NULL) {
+    for(p=0;p<n;p++) total += weight[p];
+  }
 
-        //printf("%f, %f\n",cells[h_south*params.nx + hh].speeds[0], cells[h_south*params.nx + hh].speeds[1]);
-        //copy north halo into first row of cells
-        for(hh=0;hh<params.nx;hh++){
-            for(ff=0;ff<9;ff++){
-              cells[h_south*params.nx + hh].speeds[ff]=halo_south_r[9*hh+ff];
-            }
-          }
-        //printf("%f, %f\n",cells[h_south*params.nx + hh].speeds[0], cells[h_south*params.nx + hh].speeds[1]);
+  cut[0] = 0;
+  cut[nparts] = n;
+  for(p=1;p<nparts;p++) {
+    /* the first 'rest' parts take one extra cell each */
+    if(total == 0) {
+      cut[p] = p*base + (p < rest ? p : rest);
+      continue;
+    }
+    /* each cell goes to the part its middle falls in, by weight,
+    ** as long as every part keeps its minimum */
+    while(ii < n && (2*sum + weight[ii])*nparts <= 2*total*p) sum += weight[ii++];
+    while(ii < cut[p-1] + minimum) sum += weight[ii++];
+    while(ii > n - (nparts-p)*minimum) sum -= weight[--ii];
+    cut[p] = ii;
+  }
+}
 
-        //copy fist row into north halo
-        for(hh=0;hh<params.nx;hh++){
-          for(ff=0;ff<9;ff++){
-            halo_north[9*hh+ff] = cells[start*params.nx + hh].speeds[ff];
-          }
-        }
+/* the weight of each row, then each column, of the grid for the
+** cuts: its no. of fluid cells (BALANCE_FLUID), or 1 for every one */
+static int* base_weights(const t_param* params, const unsigned char* map)
+{
+  int* weight;          /* the result */
+  int ii,jj;            /* generic counters */
 
-        //send the north halo to the left and receive into south halo from the right
-        MPI_Sendrecv(halo_north, 9*params.nx, MPI_FLOAT, rank_left, tag, halo_north_r, 9*params.nx, MPI_FLOAT, rank_right, tag, MPI_COMM_WORLD, &status);
-        //        MPI_Sendrecv_replace(mes, 9*params.nx, MPI_FLOAT, rank_right, tag,
-        //         rank_left, tag, MPI_COMM_WORLD, &status);
-        
-        //copy south halo into last row of cells
-        for(hh=0;hh<params.nx;hh++){
-          for(ff=0;ff<9;ff++){
-            cells[h_north*params.nx + hh].speeds[ff]=halo_south_r[9*hh+ff];
-          }
-        }
-        
+  weight = (int*)malloc(sizeof(int)*(params->ny + params->nx));
+  if (weight == NULL)
+    die("cannot allocate memory for the partition",__LINE__,__FILE__);
+  for(ii=0;ii<params->ny+params->nx;ii++)
+    weight[ii] = (params->balance == BALANCE_FLUID) ? 0 : 1;
+  if(params->balance != BALANCE_FLUID) return weight;
 
-        jj=0;
-  
-  ii=h_south;
-    if( !obstacles[ii*params.nx + jj] && 
-  (cells[ii*params.nx + jj].speeds[3] - w1) > 0.0 &&
-  (cells[ii*params.nx + jj].speeds[6] - w2) > 0.0 &&
-  (cells[ii*params.nx + jj].speeds[7] - w2) > 0.0 ) {
-      /* increase 'east-side' densities */
-      cells[ii*params.nx + jj].speeds[1] += w1;
-      cells[ii*params.nx + jj].speeds[5] += w2;
-      cells[ii*params.nx + jj].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[ii*params.nx + jj].speeds[3] -= w1;
-      cells[ii*params.nx + jj].speeds[6] -= w2;
-      cells[ii*params.nx + jj].speeds[7] -= w2;
+  for(ii=0;ii<params->ny;ii++) {
+    for(jj=0;jj<params->nx;jj++) {
+      if(map[(size_t)ii*params->nx + jj]) continue;
+      weight[ii]++;
+      weight[params->ny + jj]++;
     }
+  }
 
+  return weight;
+}
 
+void partition(t_param* params, const unsigned char* map)
+{
+  int* weight = NULL;   /* fluid cells in each row, then each column */
+
+  row_cut = (int*)malloc(sizeof(int)*(params->py+1));
+  col_cut = (int*)malloc(sizeof(int)*(params->px+1));
+  if (row_cut == NULL || col_cut == NULL)
+    die("cannot allocate memory for the partition",__LINE__,__FILE__);
+
+  /* only the master has the obstacles to weigh the rows and columns */
+  if(rank==MASTER) {
+    if(params->balance == BALANCE_FLUID) weight = base_weights(params, map);
+    /* a time block needs its halos from the nearest neighbours */
+    cut_axis(params->ny, params->py, weight, params->depth, row_cut);
+    cut_axis(params->nx, params->px, weight ? weight + params->ny : NULL, params->depth, col_cut);
+    free(weight);
+  }
+  MPI_Bcast(row_cut, params->py+1, MPI_INT, MASTER, comm);
+  MPI_Bcast(col_cut, params->px+1, MPI_INT, MASTER, comm);
+}
 
-  for(jj=0;jj<params.nx;jj++) {  
-      y_n = (ii + 1) % params.ny;
-      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
-
+t_speed* alloc_speeds(int ncells, int origin)
+{
+  t_speed* lattice;  /* the planes */
+  void*    block;    /* one allocation backing all of them */
+  int      plane;    /* floats per plane, padded to the alignment */
+  int      kk;
+
+  lattice = (t_speed*)malloc(sizeof(t_speed));
+  if (lattice == NULL) return NULL;
+
+  plane = (ncells*sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT / sizeof(float);
+  if (posix_memalign(&block, ALIGNMENT, sizeof(float)*NSPEEDS*plane) != 0) {
+    free(lattice);
+    return NULL;
+  }
 
-      x_e = (jj + 1) % params.nx;
-      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
+  for(kk=0;kk<NSPEEDS;kk++) {
+    lattice->speeds[kk] = (float*)block + kk*plane + origin;
+  }
+  lattice->swapped = FALSE;
+  lattice->index = NULL;
 
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */  
-      tmp_cells[ii *params.nx + jj].speeds[0]  = cells[ii*params.nx + jj].speeds[0]; /* central cell, */
-                                                                                     /* no movement   */
-      tmp_cells[ii *params.nx + x_e].speeds[1] = cells[ii*params.nx + jj].speeds[1]; /* east */
-      tmp_cells[y_n*params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[2]; /* north */
-      tmp_cells[ii *params.nx + x_w].speeds[3] = cells[ii*params.nx + jj].speeds[3]; /* west */
-      tmp_cells[y_s*params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[4]; /* south */
-      tmp_cells[y_n*params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
-      tmp_cells[y_n*params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
-      tmp_cells[y_s*params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[7]; /* south-west */      
-      tmp_cells[y_s*params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[8]; /* south-east */      
+  return lattice;
+}
 
+void free_speeds(t_speed* lattice, int origin)
+{
+  if (lattice == NULL) return;
+  free(lattice->speeds[0] - origin);
+  free(lattice);
 }
 
-  jj=0;
-  ii=h_north;
-    if( !obstacles[ii*params.nx + jj] && 
-  (cells[ii*params.nx + jj].speeds[3] - w1) > 0.0 &&
-  (cells[ii*params.nx + jj].speeds[6] - w2) > 0.0 &&
-  (cells[ii*params.nx + jj].speeds[7] - w2) > 0.0 ) {
-      /* increase 'east-side' densities */
-      cells[ii*params.nx + jj].speeds[1] += w1;
-      cells[ii*params.nx + jj].speeds[5] += w2;
-      cells[ii*params.nx + jj].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[ii*params.nx + jj].speeds[3] -= w1;
-      cells[ii*params.nx + jj].speeds[6] -= w2;
-      cells[ii*params.nx + jj].speeds[7] -= w2;
+/* number the fluid cells of this rank's block and its halos as the
+** slots of a sparse lattice, and work out where each owned one pulls
+** its densities from; returns the no. of slots to allocate */
+int sparse_init(const t_param params, unsigned char* obstacles)
+{
+  int ii,jj,kk;        /* generic counters */
+  int pass;            /* interior, edge or halo cells */
+  int inner,halo_cell; /* which of those (ii,jj) is */
+  int slot = 0;        /* next free slot */
+  int up;              /* upstream cell */
+  const int ncells = (params.local_ny+2)*params.width;
+
+  sparse.index = (int*)malloc(sizeof(int)*ncells);
+  if (sparse.index == NULL)
+    die("cannot allocate memory for the sparse lattice",__LINE__,__FILE__);
+
+  /* the interior of the block first, which needs nothing from the
+  ** halos, then the owned cells along its edges, then the halos */
+  for(pass=0;pass<3;pass++) {
+    if(pass==1) sparse.ninner = slot;
+    if(pass==2) sparse.nfluid = slot;
+    for(ii=0;ii<params.local_ny+2;ii++) {
+      for(jj=0;jj<params.width;jj++) {
+        halo_cell = (ii == 0 || ii == params.local_ny+1 || jj == 0 || jj == params.local_nx+1);
+        inner = !halo_cell && ii > 1 && ii < params.local_ny && jj > 1 && jj < params.local_nx;
+        if(pass != (inner ? 0 : halo_cell ? 2 : 1)) continue;
+        sparse.index[ii*params.width + jj] = obstacles[ii*params.width + jj] ? -1 : slot++;
+      }
     }
+  }
+  sparse.nslots = slot;
 
+  /* every obstacle shares one extra slot, which is never swept */
+  for(ii=0;ii<ncells;ii++) {
+    if(sparse.index[ii] < 0) sparse.index[ii] = sparse.nslots;
+  }
 
+  sparse.upstream[0] = (int*)malloc(sizeof(int)*(NSPEEDS-1)*(sparse.nfluid > 0 ? sparse.nfluid : 1));
+  if (sparse.upstream[0] == NULL)
+    die("cannot allocate memory for the sparse lattice",__LINE__,__FILE__);
+  for(kk=1;kk<NSPEEDS;kk++) sparse.upstream[kk] = sparse.upstream[0] + (kk-1)*sparse.nfluid;
+
+  for(ii=1;ii<=params.local_ny;ii++) {
+    for(jj=1;jj<=params.local_nx;jj++) {
+      slot = sparse.index[ii*params.width + jj];
+      if(slot == sparse.nslots) continue;
+      for(kk=1;kk<NSPEEDS;kk++) {
+        up = sparse.index[(ii - cy[kk])*params.width + jj - cx[kk]];
+        sparse.upstream[kk][slot] = (up == sparse.nslots) ? -1 : up;
+      }
+    }
+  }
 
-/* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-  for(jj=0;jj<params.nx;jj++) {  
-      y_n = (ii + 1) % params.ny;
-      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
-
-
-      x_e = (jj + 1) % params.nx;
-      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
-
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */  
-      tmp_cells[ii *params.nx + jj].speeds[0]  = cells[ii*params.nx + jj].speeds[0]; /* central cell, */
-                                                                                     /* no movement   */
-      tmp_cells[ii *params.nx + x_e].speeds[1] = cells[ii*params.nx + jj].speeds[1]; /* east */
-      tmp_cells[y_n*params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[2]; /* north */
-      tmp_cells[ii *params.nx + x_w].speeds[3] = cells[ii*params.nx + jj].speeds[3]; /* west */
-      tmp_cells[y_s*params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[4]; /* south */
-      tmp_cells[y_n*params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
-      tmp_cells[y_n*params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
-      tmp_cells[y_s*params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[7]; /* south-west */      
-      tmp_cells[y_s*params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[8]; /* south-east */      
-
+  return sparse.nslots + 1;
 }
 
-
-  for(ii=start;ii<=end;ii++) {
-    jj=0;
- 
-    if( !obstacles[ii*params.nx + jj] && 
-  (cells[ii*params.nx + jj].speeds[3] - w1) > 0.0 &&
-  (cells[ii*params.nx + jj].speeds[6] - w2) > 0.0 &&
-  (cells[ii*params.nx + jj].speeds[7] - w2) > 0.0 ) {
-      /* increase 'east-side' densities */
-      cells[ii*params.nx + jj].speeds[1] += w1;
-      cells[ii*params.nx + jj].speeds[5] += w2;
-      cells[ii*params.nx + jj].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[ii*params.nx + jj].speeds[3] -= w1;
-      cells[ii*params.nx + jj].speeds[6] -= w2;
-      cells[ii*params.nx + jj].speeds[7] -= w2;
+/* list, for each speed, the owned obstacle cells whose neighbour in
+** that direction is fluid: the density rebound() mirrors into that
+** speed streams out into the neighbour at the next step.  The halo
+** frame of obstacles covers the neighbours on other ranks */
+void boundary_init(const t_param params, unsigned char* obstacles)
+{
+  int ii,jj,kk;   /* generic counters */
+  int idx;        /* local index of the cell */
+  int total;      /* no. of entries over all the speeds */
+  int pass;       /* counting, then filling in */
+
+  for(pass=0;pass<2;pass++) {
+    total = 0;
+    for(kk=1;kk<NSPEEDS;kk++) {
+      if(pass==1) boundary.cells[kk] = boundary.cells[1] + total;
+      boundary.count[kk] = 0;
+      for(ii=1;ii<=params.local_ny;ii++) {
+        for(jj=1;jj<=params.local_nx;jj++) {
+          idx = ii*params.width + jj;
+          if(!obstacles[idx] || obstacles[idx + cy[kk]*params.width + cx[kk]]) continue;
+          if(pass==1) boundary.cells[kk][boundary.count[kk]] = idx;
+          boundary.count[kk]++;
+        }
+      }
+      total += boundary.count[kk];
     }
+    if(pass==0) {
+      boundary.cells[1] = (int*)malloc(sizeof(int)*(total > 0 ? total : 1));
+      if (boundary.cells[1] == NULL)
+        die("cannot allocate memory for the boundary cells",__LINE__,__FILE__);
+    }
+  }
+  boundary.cells[0] = NULL;
+}
 
+void choose_grid(t_param* params)
+{
+  int px,py;        /* candidate no. of ranks along each axis */
+  int cost;         /* halo cells per rank, give or take */
+  int best = -1;
+
+  /* the factorisation of nprocs with the shortest block perimeter
+  ** that still leaves every rank a cell along each axis; ties go
+  ** to more ranks along y, as whole rows are cheaper to send */
+  for(py=1;py<=nprocs;py++) {
+    if(nprocs % py != 0) continue;
+    px = nprocs / py;
+    if(px > params->nx || py > params->ny) continue;
+    cost = (params->nx + px - 1)/px + (params->ny + py - 1)/py;
+    if(best < 0 || cost <= best) {
+      best = cost;
+      params->px = px;
+      params->py = py;
+    }
+  }
+  if(best < 0)
+    die("more ranks than cells in the grid",__LINE__,__FILE__);
+}
 
+/* skip blanks (not newlines) and read a decimal integer at *pp,
+** returning FALSE if there is none before end, or it does not fit
+** in an int */
+static int parse_int(const char** pp, const char* end, int* value)
+{
+  const char* p = *pp;
+  int sign = 1;
+  long long v = 0;
+
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+  if(p < end && (*p == '-' || *p == '+')) {
+    if(*p == '-') sign = -1;
+    p++;
+  }
+  if(p == end || *p < '0' || *p > '9') return FALSE;
+  while(p < end && *p >= '0' && *p <= '9' && v <= INT_MAX) v = 10*v + (*p++ - '0');
+  if(sign*v > INT_MAX || sign*v < INT_MIN) return FALSE;
+  *value = (int)(sign*v);
+  *pp = p;
 
+  return TRUE;
+}
 
+/* read a whole obstacle file into a map of the global grid, one byte
+** per cell; only the master calls this */
+static unsigned char* read_obstacles(const char* obstaclefile, const t_param* params)
+{
+  char   message[1024];  /* message buffer */
+  FILE   *fp;            /* file pointer */
+  char*  text;           /* the whole file */
+  long   size;           /* in bytes */
+  const char* p;         /* parsing position */
+  const char* end;
+  unsigned char* map;    /* the blocked cells */
+  t_obstacle_header header;
+  int*   run;            /* row, first column & no. of cells of a run */
+  int    xx,yy;          /* generic array indices */
+  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int    ii;             /* generic counter */
 
-    for(jj=0;jj<params.nx;jj++) {
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      y_n = (ii + 1) % params.ny;
-      y_s = (ii == 0) ? (ii + params.ny - 1) : (ii - 1);
-
-
-      x_e = (jj + 1) % params.nx;
-      x_w = (jj == 0) ? (jj + params.nx - 1) : (jj - 1);
+  /* open the obstacle data file and read it in one go */
+  fp = fopen(obstaclefile,"rb");
+  if (fp == NULL) {
+    sprintf(message,"could not open input obstacles file: %s", obstaclefile);
+    die(message,__LINE__,__FILE__);
+  }
+  if(fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0)
+    die("could not find the size of the obstacle file",__LINE__,__FILE__);
+  text = (char*)malloc(size > 0 ? size : 1);
+  if (text == NULL)
+    die("cannot allocate memory for the obstacle file",__LINE__,__FILE__);
+  if(fread(text, 1, size, fp) != (size_t)size)
+    die("could not read the obstacle file",__LINE__,__FILE__);
+  fclose(fp);
 
-      /* propagate densities to neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */  
-      tmp_cells[ii *params.nx + jj].speeds[0]  = cells[ii*params.nx + jj].speeds[0]; /* central cell, */
-                                                                                     /* no movement   */
-      tmp_cells[ii *params.nx + x_e].speeds[1] = cells[ii*params.nx + jj].speeds[1]; /* east */
-      tmp_cells[y_n*params.nx + jj].speeds[2]  = cells[ii*params.nx + jj].speeds[2]; /* north */
-      tmp_cells[ii *params.nx + x_w].speeds[3] = cells[ii*params.nx + jj].speeds[3]; /* west */
-      tmp_cells[y_s*params.nx + jj].speeds[4]  = cells[ii*params.nx + jj].speeds[4]; /* south */
-      tmp_cells[y_n*params.nx + x_e].speeds[5] = cells[ii*params.nx + jj].speeds[5]; /* north-east */
-      tmp_cells[y_n*params.nx + x_w].speeds[6] = cells[ii*params.nx + jj].speeds[6]; /* north-west */
-      tmp_cells[y_s*params.nx + x_w].speeds[7] = cells[ii*params.nx + jj].speeds[7]; /* south-west */      
-      tmp_cells[y_s*params.nx + x_e].speeds[8] = cells[ii*params.nx + jj].speeds[8]; /* south-east */      
+  map = (unsigned char*)calloc((size_t)params->nx*params->ny, 1);
+  if (map == NULL)
+    die("cannot allocate memory for the obstacle map",__LINE__,__FILE__);
+
+  /* runs of blocked cells, see t_obstacle_header */
+  if(size >= (long)sizeof(header) && memcmp(text, OBSTACLE_MAGIC, sizeof(header.magic)) == 0) {
+    memcpy(&header, text, sizeof(header));
+    if(header.nx != params->nx || header.ny != params->ny)
+      die("obstacle file is for a different grid",__LINE__,__FILE__);
+    if(header.nruns < 0 ||
+       size != (long)(sizeof(header) + (size_t)header.nruns*3*sizeof(int)))
+      die("obstacle file is truncated",__LINE__,__FILE__);
+    for(ii=0;ii<header.nruns;ii++) {
+      run = (int*)(text + sizeof(header)) + 3*ii;
+      if ( run[0]<0 || run[0]>params->ny-1 )
+        die("obstacle y-coord out of range",__LINE__,__FILE__);
+      if ( run[1]<0 || run[2]<1 || run[2]>params->nx-run[1] )
+        die("obstacle x-coord out of range",__LINE__,__FILE__);
+      memset(&map[(size_t)run[0]*params->nx + run[1]], 1, run[2]);
     }
   }
-    
-
-  return EXIT_SUCCESS;
-}
-
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
-{
-  int ii,jj;  /* generic counters */
-    //#pragma omp parallel for private(jj)
-  /* loop over the cells in the grid */
-     int start=0, end=0;
-   if(params.rest!=0){
-    if(rank>=params.rest){
-      start = params.rest*(params.ny/nprocs+1) + (rank-params.rest)*(params.ny/nprocs);
-      end= start+params.ny/nprocs-1;
-    }
-    else{
-      start = rank*(params.ny/nprocs+1);
-      end = start+params.ny/nprocs;
-    }
-   }
-  for(ii=start;ii<=end;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      /* if the cell contains an obstacle */
-      if(obstacles[ii*params.nx + jj]) {
-  /* called after propagate, so taking values from scratch space
-  ** mirroring, and writing into main grid */
-  cells[ii*params.nx + jj].speeds[1] = tmp_cells[ii*params.nx + jj].speeds[3];
-  cells[ii*params.nx + jj].speeds[2] = tmp_cells[ii*params.nx + jj].speeds[4];
-  cells[ii*params.nx + jj].speeds[3] = tmp_cells[ii*params.nx + jj].speeds[1];
-  cells[ii*params.nx + jj].speeds[4] = tmp_cells[ii*params.nx + jj].speeds[2];
-  cells[ii*params.nx + jj].speeds[5] = tmp_cells[ii*params.nx + jj].speeds[7];
-  cells[ii*params.nx + jj].speeds[6] = tmp_cells[ii*params.nx + jj].speeds[8];
-  cells[ii*params.nx + jj].speeds[7] = tmp_cells[ii*params.nx + jj].speeds[5];
-  cells[ii*params.nx + jj].speeds[8] = tmp_cells[ii*params.nx + jj].speeds[6];
-      }
+  /* or one blocked cell per line: x y 1 */
+  else {
+    p = text;
+    end = text + size;
+    for(;;) {
+      while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+      if(p == end) break;
+      if(!parse_int(&p, end, &xx) || !parse_int(&p, end, &yy) || !parse_int(&p, end, &blocked))
+        die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
+      while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+      if(p < end && *p != '\n')
+        die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
+      /* some checks */
+      if ( xx<0 || xx>params->nx-1 )
+        die("obstacle x-coord out of range",__LINE__,__FILE__);
+      if ( yy<0 || yy>params->ny-1 )
+        die("obstacle y-coord out of range",__LINE__,__FILE__);
+      if ( blocked != 1 )
+        die("obstacle blocked value should be 1",__LINE__,__FILE__);
+      map[(size_t)yy*params->nx + xx] = (unsigned char)blocked;
     }
   }
 
-  return EXIT_SUCCESS;
+  free(text);
+
+  return map;
 }
 
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+/* copy the block of rows start..end by columns start_x..end_x of the
+** global map, with its frame of halo cells wrapped around the edges
+** of the grid, into frame */
+static void pack_frame(const t_param* params, const unsigned char* map,
+                       int start, int end, int start_x, int end_x, unsigned char* frame)
 {
-  int ii,jj;                 /* generic counters */
-    /* square of speed of sound */
-  const float w0 = 0.4444444444;    /* weighting factor */
-  const float w1 = 0.1111111111;    /* weighting factor */
-  const float w2 = 0.0277777777;   /* weighting factor */
-  float u_x,u_y;               /* av. velocities in x and y directions */
-  float u_sq;                  /* squared velocity */
-  float local_density;         /* sum of densities in a particular cell */
-  
-  
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
-  //#pragma omp parallel private(ii, jj, u_x, u_y, u_sq, local_density)
-  //#pragma omp for
-    int start=0, end=0;
-   if(params.rest!=0){
-    if(rank>=params.rest){
-      start = params.rest*(params.ny/nprocs+1) + (rank-params.rest)*(params.ny/nprocs);
-      end= start+params.ny/nprocs-1;
-    }
-    else{
-      start = rank*(params.ny/nprocs+1);
-      end = start+params.ny/nprocs;
-    }
-   }
-  for(ii=start;ii<=end;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-      /* don't consider occupied cells */
-      if(!obstacles[ii*params.nx + jj]) {
-          /* compute local density total */
-              local_density = tmp_cells[ii*params.nx + jj].speeds[0]+tmp_cells[ii*params.nx + jj].speeds[1]+tmp_cells[ii*params.nx + jj].speeds[2]+tmp_cells[ii*params.nx + jj].speeds[3]+tmp_cells[ii*params.nx + jj].speeds[4]+tmp_cells[ii*params.nx + jj].speeds[5]+tmp_cells[ii*params.nx + jj].speeds[6]+tmp_cells[ii*params.nx + jj].speeds[7]+tmp_cells[ii*params.nx + jj].speeds[8];
-              
-          /* compute x velocity component */
-          u_x = (tmp_cells[ii*params.nx + jj].speeds[1] + tmp_cells[ii*params.nx + jj].speeds[5] + tmp_cells[ii*params.nx + jj].speeds[8]- (tmp_cells[ii*params.nx + jj].speeds[3] + tmp_cells[ii*params.nx + jj].speeds[6] + tmp_cells[ii*params.nx + jj].speeds[7]))/(local_density);
-          
-          /* compute y velocity component */
-          u_y = (tmp_cells[ii*params.nx + jj].speeds[2] +tmp_cells[ii*params.nx + jj].speeds[5] + tmp_cells[ii*params.nx + jj].speeds[6]- (tmp_cells[ii*params.nx + jj].speeds[4] + tmp_cells[ii*params.nx + jj].speeds[7] +tmp_cells[ii*params.nx + jj].speeds[8]))/(local_density);
-         
-          /* velocity squared */ 
-          u_sq = (u_x * u_x + u_y * u_y)*1.5;
-  //unrolling everything
-  
-  
-  
-  
-  cells[ii*params.nx + jj].speeds[0] = (tmp_cells[ii*params.nx + jj].speeds[0]+params.omega*((w0 * local_density * (1.0 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[0]));
-  
-  cells[ii*params.nx + jj].speeds[1] = (tmp_cells[ii*params.nx + jj].speeds[1]+params.omega*((w1 * local_density * (1.0 + u_x *3 + (u_x * u_x)*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[1]));
-  
-
-  
-  cells[ii*params.nx + jj].speeds[2] = (tmp_cells[ii*params.nx + jj].speeds[2]+params.omega*((w1 * local_density * (1.0 + u_y*3 + (u_y * u_y)*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[2]));
-  
-  cells[ii*params.nx + jj].speeds[3] = (tmp_cells[ii*params.nx + jj].speeds[3]+params.omega*((w1 * local_density * (1.0 -u_x*3 + (u_x * u_x)*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[3]));
-  
-
-  
-  cells[ii*params.nx + jj].speeds[4] = (tmp_cells[ii*params.nx + jj].speeds[4]+params.omega*((w1 * local_density * (1.0 -u_y*3 + (u_y*u_y)*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[4]));
-  
-  cells[ii*params.nx + jj].speeds[5] = (tmp_cells[ii*params.nx + jj].speeds[5]+params.omega*((w2 * local_density * (1.0 + (u_x+u_y)*3 + ((u_x+u_y) * (u_x+u_y))*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[5]));
-  
-  
-  cells[ii*params.nx + jj].speeds[6] = (tmp_cells[ii*params.nx + jj].speeds[6]+params.omega*((w2 * local_density * (1.0 + (u_y-u_x)*3 + ((u_y-u_x) * (u_y-u_x))*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[6]));
-  
-  cells[ii*params.nx + jj].speeds[7] = (tmp_cells[ii*params.nx + jj].speeds[7]+params.omega*((w2 * local_density * (1.0 + (-u_y-u_x)*3 + ((-u_y-u_x) * (-u_y-u_x))*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[7]));
-  
-  cells[ii*params.nx + jj].speeds[8] = (tmp_cells[ii*params.nx + jj].speeds[8]+params.omega*((w2 * local_density * (1.0 + (u_x-u_y)*3 + ((u_x-u_y) * (u_x-u_y))*4.5 - u_sq)) - tmp_cells[ii*params.nx + jj].speeds[8]));  
-  
-      }
-      
+  int ii,jj;                     /* generic counters */
+  int yy,xx;                     /* global indices */
+  const int width = end_x - start_x + 1 + 2*params->depth;
+
+  for(ii=0;ii<end-start+1+2*params->depth;ii++) {
+    yy = (start - params->depth + ii + params->ny) % params->ny;
+    for(jj=0;jj<width;jj++) {
+      xx = (start_x - params->depth + jj + params->nx) % params->nx;
+      frame[ii*width + jj] = map[(size_t)yy*params->nx + xx];
     }
   }
-
-  return EXIT_SUCCESS; 
 }
 
 int initialise(const char* paramfile, const char* obstaclefile,
-         t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr, 
-         int** obstacles_ptr, float** av_vels_ptr)
+         t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+         unsigned char** obstacles_ptr)
 {
   char   message[1024];  /* message buffer */
   FILE   *fp;            /* file pointer */
   int    ii,jj;          /* generic counters */
-  int    xx,yy;          /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */ 
   int    retval;         /* to hold return value for checking */
-  float w0,w1,w2;       /* weighting factors */
+  int    iparams[4];     /* the integer parameters, as broadcast */
+  float  fparams[3];     /* and the real ones */
+  int    nfluid;         /* no. of fluid cells owned by this rank */
+  int    dims[2];        /* ranks along y and x */
+  int    periods[2] = { TRUE, TRUE };
+  int    coords[2];      /* of this rank, y first */
+  int    nb[2];          /* of a diagonal neighbour (wrapped by MPI) */
+  int    kk;             /* direction counter */
+
+  /* only the master reads the input files; the other ranks are
+  ** sent the parameters, and later the obstacles in their block */
+  if(rank==MASTER) {
+    /* open the parameter file */
+    fp = fopen(paramfile,"r");
+    if (fp == NULL) {
+      sprintf(message,"could not open input parameter file: %s", paramfile);
+      die(message,__LINE__,__FILE__);
+    }
 
-  /* open the parameter file */
-  fp = fopen(paramfile,"r");
-  if (fp == NULL) {
-    sprintf(message,"could not open input parameter file: %s", paramfile);
-    die(message,__LINE__,__FILE__);
+    /* read in the parameter values */
+    retval = fscanf(fp,"%d\n",&(params->nx));
+    if(retval != 1) die ("could not read param file: nx",__LINE__,__FILE__);
+    retval = fscanf(fp,"%d\n",&(params->ny));
+    if(retval != 1) die ("could not read param file: ny",__LINE__,__FILE__);
+    retval = fscanf(fp,"%d\n",&(params->maxIters));
+    if(retval != 1) die ("could not read param file: maxIters",__LINE__,__FILE__);
+    retval = fscanf(fp,"%d\n",&(params->reynolds_dim));
+    if(retval != 1) die ("could not read param file: reynolds_dim",__LINE__,__FILE__);
+    retval = fscanf(fp,"%f\n",&(params->density));
+    if(retval != 1) die ("could not read param file: density",__LINE__,__FILE__);
+    retval = fscanf(fp,"%f\n",&(params->accel));
+    if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
+    retval = fscanf(fp,"%f\n",&(params->omega));
+    if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
+
+    /* and close up the file */
+    fclose(fp);
+
+    iparams[0] = params->nx;
+    iparams[1] = params->ny;
+    iparams[2] = params->maxIters;
+    iparams[3] = params->reynolds_dim;
+    fparams[0] = params->density;
+    fparams[1] = params->accel;
+    fparams[2] = params->omega;
+  }
+  MPI_Bcast(iparams, 4, MPI_INT, MASTER, MPI_COMM_WORLD);
+  MPI_Bcast(fparams, 3, MPI_FLOAT, MASTER, MPI_COMM_WORLD);
+  params->nx = iparams[0];
+  params->ny = iparams[1];
+  params->maxIters = iparams[2];
+  params->reynolds_dim = iparams[3];
+  params->density = fparams[0];
+  params->accel = fparams[1];
+  params->omega = fparams[2];
+
+  /* arrange the ranks in a periodic grid and work out which
+  ** block of cells belongs to this one */
+  if(params->px == 0) choose_grid(params);
+  if(params->px*params->py != nprocs)
+    die("the grid of ranks does not match the no. of ranks",__LINE__,__FILE__);
+  if(params->px > params->nx || params->py > params->ny)
+    die("more ranks along an axis than cells in the grid",__LINE__,__FILE__);
+  dims[0] = params->py;
+  dims[1] = params->px;
+  MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, TRUE, &comm);
+  MPI_Comm_rank(comm, &rank);
+  MPI_Cart_coords(comm, rank, 2, coords);
+
+  /* a time block only draws on the nearest neighbours for its halos */
+  if(params->ny / params->py < params->depth || params->nx / params->px < params->depth)
+    die("--steps is deeper than the blocks of the grid",__LINE__,__FILE__);
+
+  /* the master parses the obstacle file into a map of the whole grid,
+  ** which the grid is cut by */
+  if(rank==MASTER) obstacle_map = read_obstacles(obstaclefile, params);
+  partition(params, obstacle_map);
+
+  /* the neighbours along the axes, then the diagonal ones */
+  MPI_Cart_shift(comm, 0, 1, &neighbour[4], &neighbour[2]);
+  MPI_Cart_shift(comm, 1, 1, &neighbour[3], &neighbour[1]);
+  for(kk=5;kk<NSPEEDS;kk++) {
+    nb[0] = coords[0] + cy[kk];
+    nb[1] = coords[1] + cx[kk];
+    MPI_Cart_rank(comm, nb, &neighbour[kk]);
   }
 
-  /* read in the parameter values */
-  retval = fscanf(fp,"%d\n",&(params->nx));
-  if(retval != 1) die ("could not read param file: nx",__LINE__,__FILE__);
-  retval = fscanf(fp,"%d\n",&(params->ny));
-  if(retval != 1) die ("could not read param file: ny",__LINE__,__FILE__);
-  retval = fscanf(fp,"%d\n",&(params->maxIters));
-  if(retval != 1) die ("could not read param file: maxIters",__LINE__,__FILE__);
-  retval = fscanf(fp,"%d\n",&(params->reynolds_dim));
-  if(retval != 1) die ("could not read param file: reynolds_dim",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->density));
-  if(retval != 1) die ("could not read param file: density",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->accel));
-  if(retval != 1) die ("could not read param file: accel",__LINE__,__FILE__);
-  retval = fscanf(fp,"%f\n",&(params->omega));
-  if(retval != 1) die ("could not read param file: omega",__LINE__,__FILE__);
-
-  /* and close up the file */
-  fclose(fp);
+  build_block(params, cells_ptr, tmp_cells_ptr, obstacles_ptr);
+
+  /* the map is only needed again if the blocks may move */
+  if(params->rebalance_every == 0) {
+    free(obstacle_map);
+    obstacle_map = NULL;
+  }
+
+  /* the obstacles never move, so the no. of fluid cells the
+  ** average velocity is taken over is counted once, here */
+  nfluid = 0;
+  for(ii=1;ii<=params->local_ny;ii++) {
+    for(jj=1;jj<=params->local_nx;jj++) {
+      if(!(*obstacles_ptr)[ii*params->width + jj]) nfluid++;
+    }
+  }
+  MPI_Allreduce(&nfluid, &(params->tot_cells), 1, MPI_INT, MPI_SUM, comm);
+
+  return EXIT_SUCCESS;
+}
+
+void build_block(t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+                 unsigned char** obstacles_ptr)
+{
+  int    ii;             /* generic counter */
+  int    local_rows;     /* no. of local rows including the halos */
+  int    ncells;         /* no. of cells in each plane of the lattice */
+  unsigned char* frame;  /* obstacles of a rank's block and halos */
+  int    start,end;      /* rows of that block */
+  int    start_x,end_x;  /* and its columns */
+  int    source;         /* rank it belongs to */
+  int    coords[2];      /* of this rank, y first */
+  int    nb[2];          /* of another rank */
+  int    kk;             /* speed counter */
+  float w0,w1,w2;       /* weighting factors */
 
-  /* 
+  MPI_Cart_coords(comm, rank, 2, coords);
+  params->start = row_cut[coords[0]];
+  params->end = row_cut[coords[0]+1] - 1;
+  params->start_x = col_cut[coords[1]];
+  params->end_x = col_cut[coords[1]+1] - 1;
+  params->local_ny = params->end - params->start + 1;
+  params->local_nx = params->end_x - params->start_x + 1;
+  params->width = params->local_nx + 2*params->depth;
+  params->origin = (params->depth - 1)*(params->width + 1);
+  local_rows = params->local_ny + 2*params->depth;
+
+  /*
   ** Allocate memory.
   **
   ** Remember C is pass-by-value, so we need to
@@ -837,152 +2160,382 @@ int initialise(const char* paramfile, const char* obstaclefile,
   ** we want to access elements of this array.
   **
   ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
+  ** hold one such array per 'speed' (see
+  ** alloc_speeds()).
+  **
+  ** Only this rank's block and its frame of halo
+  ** cells are allocated.
   */
 
-  /* main grid */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed)*(params->ny*params->nx));
-  if (*cells_ptr == NULL) 
-    die("cannot allocate memory for cells",__LINE__,__FILE__);
-
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = (t_speed*)malloc(sizeof(t_speed)*(params->ny*params->nx));
-  if (*tmp_cells_ptr == NULL) 
-    die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
-  
   /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int*)*(params->ny*params->nx));
-  if (*obstacles_ptr == NULL) 
+  *obstacles_ptr = malloc(local_rows*params->width);
+  if (*obstacles_ptr == NULL)
     die("cannot allocate column memory for obstacles",__LINE__,__FILE__);
 
+  /* the master sends each rank just its block of the map, halos
+  ** included, in a buffer big enough for the largest block */
+  if(rank==MASTER) {
+    start = end = 0;
+    for(kk=0;kk<params->py;kk++) {
+      if(row_cut[kk+1] - row_cut[kk] > start) start = row_cut[kk+1] - row_cut[kk];
+    }
+    for(kk=0;kk<params->px;kk++) {
+      if(col_cut[kk+1] - col_cut[kk] > end) end = col_cut[kk+1] - col_cut[kk];
+    }
+    frame = (unsigned char*)malloc((start + 2*params->depth)*(end + 2*params->depth));
+    if (frame == NULL)
+      die("cannot allocate memory for obstacles",__LINE__,__FILE__);
+    for(source=0;source<nprocs;source++) {
+      if(source == MASTER) continue;
+      MPI_Cart_coords(comm, source, 2, nb);
+      start = row_cut[nb[0]];
+      end = row_cut[nb[0]+1] - 1;
+      start_x = col_cut[nb[1]];
+      end_x = col_cut[nb[1]+1] - 1;
+      pack_frame(params, obstacle_map, start, end, start_x, end_x, frame);
+      MPI_Send(frame, (end-start+1+2*params->depth)*(end_x-start_x+1+2*params->depth), MPI_UNSIGNED_CHAR,
+               source, TAG_OBSTACLES, comm);
+    }
+    pack_frame(params, obstacle_map, params->start, params->end, params->start_x, params->end_x, *obstacles_ptr);
+    free(frame);
+  }
+  else {
+    MPI_Recv(*obstacles_ptr, local_rows*params->width, MPI_UNSIGNED_CHAR,
+             MASTER, TAG_OBSTACLES, comm, MPI_STATUS_IGNORE);
+  }
+  *obstacles_ptr += params->origin;
+
+  /* a sparse lattice only has room for the fluid cells */
+  if (params->kernel == KERNEL_SPARSE) ncells = sparse_init(*params, *obstacles_ptr);
+  else ncells = local_rows*params->width;
+  if (params->kernel == KERNEL_SPLIT) boundary_init(*params, *obstacles_ptr);
+
+  /* main grid */
+  *cells_ptr = alloc_speeds(ncells, params->origin);
+  if (*cells_ptr == NULL)
+    die("cannot allocate memory for cells",__LINE__,__FILE__);
+  if (params->kernel == KERNEL_SPARSE) (*cells_ptr)->index = sparse.index;
+
+  /* 'helper' grid, used as scratch space (the AA pattern needs none) */
+  if (params->kernel != KERNEL_AA) {
+    *tmp_cells_ptr = alloc_speeds(ncells, params->origin);
+    if (*tmp_cells_ptr == NULL)
+      die("cannot allocate memory for tmp_cells",__LINE__,__FILE__);
+    (*tmp_cells_ptr)->index = (*cells_ptr)->index;
+  }
+
   /* initialise densities */
   w0 = params->density * 4.0/9.0;
   w1 = params->density      /9.0;
   w2 = params->density      /36.0;
 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      /* centre */
-      (*cells_ptr)[ii*params->nx + jj].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii*params->nx + jj].speeds[1] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[2] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[3] = w1;
-      (*cells_ptr)[ii*params->nx + jj].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii*params->nx + jj].speeds[5] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[6] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[7] = w2;
-      (*cells_ptr)[ii*params->nx + jj].speeds[8] = w2;
-    }
-  }
-
-  /* first set all cells in obstacle array to zero */ 
-  for(ii=0;ii<params->ny;ii++) {
-    for(jj=0;jj<params->nx;jj++) {
-      (*obstacles_ptr)[ii*params->nx + jj] = 0;
+  /* with threads, each one first touches the cells it will sweep,
+  ** so that their pages are placed on its NUMA node; the scratch
+  ** grid is filled in here for the same reason */
+  #pragma omp parallel for private(kk) schedule(static)
+  for(ii=-params->origin;ii<ncells-params->origin;ii++) {
+    /* centre */
+    (*cells_ptr)->speeds[0][ii] = w0;
+    /* axis directions */
+    (*cells_ptr)->speeds[1][ii] = w1;
+    (*cells_ptr)->speeds[2][ii] = w1;
+    (*cells_ptr)->speeds[3][ii] = w1;
+    (*cells_ptr)->speeds[4][ii] = w1;
+    /* diagonals */
+    (*cells_ptr)->speeds[5][ii] = w2;
+    (*cells_ptr)->speeds[6][ii] = w2;
+    (*cells_ptr)->speeds[7][ii] = w2;
+    (*cells_ptr)->speeds[8][ii] = w2;
+    if (*tmp_cells_ptr != NULL) {
+      for(kk=0;kk<NSPEEDS;kk++)
+        (*tmp_cells_ptr)->speeds[kk][ii] = (*cells_ptr)->speeds[kk][ii];
     }
   }
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile,"r");
-  if (fp == NULL) {
-    sprintf(message,"could not open input obstacles file: %s", obstaclefile);
-    die(message,__LINE__,__FILE__);
+  /* the owned cells along each side go to the halo of the
+  ** neighbour beyond it.  Only the speeds that stream across the
+  ** side are ever read out of a halo, so only those are sent */
+  halo.aa_return = FALSE;
+  halo.tag = TAG_HALO;
+  halo_init(*params, &halo, *cells_ptr);
+
+  /* an AA even step leaves the densities leaving the block in the
+  ** halo cells, under their opposite speeds; they go back to the
+  ** cells of the owners they are heading for */
+  if (params->kernel == KERNEL_AA) {
+    halo_ret.aa_return = TRUE;
+    halo_ret.tag = TAG_HALO_RETURN;
+    halo_init(*params, &halo_ret, *cells_ptr);
   }
+}
 
-  /* read-in the blocked cells list */
-  while( (retval = fscanf(fp,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if ( retval != 3)
-      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
-    if ( xx<0 || xx>params->nx-1 )
-      die("obstacle x-coord out of range",__LINE__,__FILE__);
-    if ( yy<0 || yy>params->ny-1 )
-      die("obstacle y-coord out of range",__LINE__,__FILE__);
-    if ( blocked != 1 ) 
-      die("obstacle blocked value should be 1",__LINE__,__FILE__);
-    /* assign to array */
-    (*obstacles_ptr)[yy*params->nx + xx] = blocked;
-  }
-  
-  /* and close the file */
-  fclose(fp);
-
-  /* 
-  ** allocate space to hold a record of the avarage velocities computed 
-  ** at each timestep
+int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+       unsigned char** obstacles_ptr)
+{
+  /*
+  ** free up allocated memory
   */
-  *av_vels_ptr = (float*)malloc(sizeof(float)*params->maxIters);
+  free_block(params, cells_ptr, tmp_cells_ptr, obstacles_ptr);
+  free(obstacle_map);
+  free(row_cut);
+  free(col_cut);
+  MPI_Comm_free(&comm);
 
   return EXIT_SUCCESS;
 }
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-       int** obstacles_ptr, float** av_vels_ptr)
+void free_block(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+                unsigned char** obstacles_ptr)
 {
-  /* 
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
+  free_speeds(*cells_ptr, params->origin);
   *cells_ptr = NULL;
 
-  free(*tmp_cells_ptr);
+  free_speeds(*tmp_cells_ptr, params->origin);
   *tmp_cells_ptr = NULL;
 
-  free(*obstacles_ptr);
+  free(*obstacles_ptr - params->origin);
   *obstacles_ptr = NULL;
 
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
+  halo_free(&halo);
+  if (params->kernel == KERNEL_AA)
+    halo_free(&halo_ret);
+  if (params->kernel == KERNEL_SPARSE) {
+    free(sparse.index);
+    free(sparse.upstream[0]);
+  }
+  if (params->kernel == KERNEL_SPLIT)
+    free(boundary.cells[1]);
+}
 
-  return EXIT_SUCCESS;
+/* the part of a rank's block, as params has it, in rows first..last
+** and columns first_col..last_col, as a datatype over the densities
+** of the block packed plane by plane, nplanes of them; *count is 0
+** if there is none */
+static MPI_Datatype overlap_type(const t_param* params, int nplanes, int first, int last,
+                                 int first_col, int last_col, int* count)
+{
+  MPI_Datatype type;
+  int sizes[3],subsizes[3],starts[3];  /* of the planes and the overlap */
+
+  if(first < params->start) first = params->start;
+  if(last > params->end) last = params->end;
+  if(first_col < params->start_x) first_col = params->start_x;
+  if(last_col > params->end_x) last_col = params->end_x;
+  *count = (first <= last && first_col <= last_col);
+  if(!*count) return MPI_FLOAT;
+
+  sizes[0] = nplanes;    sizes[1] = params->local_ny;   sizes[2] = params->local_nx;
+  subsizes[0] = nplanes; subsizes[1] = last-first+1;    subsizes[2] = last_col-first_col+1;
+  starts[0] = 0;         starts[1] = first-params->start; starts[2] = first_col-params->start_x;
+  MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_FLOAT, &type);
+  MPI_Type_commit(&type);
+
+  return type;
+}
+
+void rebalance(t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+               unsigned char** obstacles_ptr, double busy)
+{
+  double* times = NULL;        /* busy time of every rank, on the master */
+  double* cost = NULL;         /* of each row, then each column, on the master */
+  double part_time,part_base;  /* of a row / column of ranks */
+  double most;                 /* largest cost */
+  double mean;                 /* busy time of the average rank */
+  int* weight = NULL;          /* the base weights, then the new ones */
+  int* old_cut;                /* the cuts the cells are in now, rows then columns */
+  int moved = FALSE;           /* whether any cut moves */
+  t_param old = *params;       /* the block the cells are in now */
+  float* sendbuf;              /* the densities of that block, plane by plane */
+  float* recvbuf;              /* and of the new block */
+  MPI_Datatype* sendtypes;     /* what goes to / comes from each rank */
+  MPI_Datatype* recvtypes;
+  int* sendcounts;
+  int* recvcounts;
+  int* displs;                 /* all zero, the types say where */
+  int coords[2];               /* of a rank, y first */
+  int ii,jj,kk,pp;             /* generic counters */
+  int n;                       /* no. of owned cells */
+  /* a sparse lattice keeps what its cells last sent the obstacles
+  ** in the scratch grid, so that has to move as well */
+  const int nplanes = (params->kernel == KERNEL_SPARSE) ? 2*NSPEEDS : NSPEEDS;
+
+  if(rank==MASTER) {
+    times = (double*)malloc(sizeof(double)*nprocs);
+    if (times == NULL)
+      die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+  }
+  MPI_Gather(&busy, 1, MPI_DOUBLE, times, 1, MPI_DOUBLE, MASTER, comm);
+
+  old_cut = (int*)malloc(sizeof(int)*(params->py + params->px + 2));
+  if (old_cut == NULL)
+    die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+  memcpy(old_cut, row_cut, sizeof(int)*(params->py+1));
+  memcpy(old_cut + params->py+1, col_cut, sizeof(int)*(params->px+1));
+
+  /* the master weighs each row (column) of the grid by its base
+  ** weight times the cost per unit of base weight measured on the
+  ** row (column) of ranks holding it, where the slowest rank sets
+  ** the pace, and cuts the grid again by those weights */
+  if(rank==MASTER) {
+    mean = 0.0;
+    most = 0.0;
+    for(pp=0;pp<nprocs;pp++) {
+      mean += times[pp] / nprocs;
+      if(times[pp] > most) most = times[pp];
+    }
+    if(most > IMBALANCE*mean) {
+      weight = base_weights(params, obstacle_map);
+      cost = (double*)malloc(sizeof(double)*(params->ny + params->nx));
+      if (cost == NULL)
+        die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+      for(kk=0;kk<2;kk++) {
+        const int nparts = kk ? params->px : params->py;
+        const int* cuts = kk ? col_cut : row_cut;
+        const int offset = kk ? params->ny : 0;
+        for(ii=0;ii<nparts;ii++) {
+          part_time = 0.0;
+          for(pp=0;pp<nprocs;pp++) {
+            MPI_Cart_coords(comm, pp, 2, coords);
+            if(coords[kk] == ii && times[pp] > part_time) part_time = times[pp];
+          }
+          part_base = 0.0;
+          for(jj=cuts[ii];jj<cuts[ii+1];jj++) part_base += weight[offset + jj];
+          for(jj=cuts[ii];jj<cuts[ii+1];jj++)
+            cost[offset + jj] = (part_base > 0.0) ? weight[offset + jj]*part_time/part_base : 0.0;
+        }
+      }
+      most = 0.0;
+      for(ii=0;ii<params->ny+params->nx;ii++) {
+        if(cost[ii] > most) most = cost[ii];
+      }
+      for(ii=0;ii<params->ny+params->nx;ii++)
+        weight[ii] = (most > 0.0) ? (int)(cost[ii]/most*WEIGHT_SCALE + 0.5) : 1;
+      cut_axis(params->ny, params->py, weight, params->depth, row_cut);
+      cut_axis(params->nx, params->px, weight + params->ny, params->depth, col_cut);
+      moved = memcmp(old_cut, row_cut, sizeof(int)*(params->py+1)) != 0 ||
+              memcmp(old_cut + params->py+1, col_cut, sizeof(int)*(params->px+1)) != 0;
+      free(weight);
+      free(cost);
+    }
+    free(times);
+  }
+  MPI_Bcast(&moved, 1, MPI_INT, MASTER, comm);
+  if(!moved) {
+    free(old_cut);
+    return;
+  }
+  MPI_Bcast(row_cut, params->py+1, MPI_INT, MASTER, comm);
+  MPI_Bcast(col_cut, params->px+1, MPI_INT, MASTER, comm);
+
+  /* pack the owned densities, which is all there is between steps */
+  n = old.local_ny*old.local_nx;
+  sendbuf = (float*)malloc(sizeof(float)*nplanes*n);
+  if (sendbuf == NULL)
+    die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+  for(kk=0;kk<nplanes;kk++) {
+    for(ii=0;ii<old.local_ny;ii++) {
+      for(jj=0;jj<old.local_nx;jj++) {
+        sendbuf[kk*n + ii*old.local_nx + jj] =
+          *speed(old.width, kk<NSPEEDS ? *cells_ptr : *tmp_cells_ptr, ii+1, jj+1, kk%NSPEEDS);
+      }
+    }
+  }
+
+  free_block(params, cells_ptr, tmp_cells_ptr, obstacles_ptr);
+  build_block(params, cells_ptr, tmp_cells_ptr, obstacles_ptr);
+
+  n = params->local_ny*params->local_nx;
+  recvbuf = (float*)malloc(sizeof(float)*nplanes*n);
+  sendtypes = (MPI_Datatype*)malloc(sizeof(MPI_Datatype)*2*nprocs);
+  sendcounts = (int*)malloc(sizeof(int)*3*nprocs);
+  if (recvbuf == NULL || sendtypes == NULL || sendcounts == NULL)
+    die("cannot allocate memory to rebalance",__LINE__,__FILE__);
+  recvtypes = sendtypes + nprocs;
+  recvcounts = sendcounts + nprocs;
+  displs = sendcounts + 2*nprocs;
+
+  /* each rank sends what of its old block falls in the new block of
+  ** another, and receives what of its new block was in the old one */
+  for(pp=0;pp<nprocs;pp++) {
+    MPI_Cart_coords(comm, pp, 2, coords);
+    sendtypes[pp] = overlap_type(&old, nplanes, row_cut[coords[0]], row_cut[coords[0]+1]-1,
+                                 col_cut[coords[1]], col_cut[coords[1]+1]-1, &sendcounts[pp]);
+    recvtypes[pp] = overlap_type(params, nplanes, old_cut[coords[0]], old_cut[coords[0]+1]-1,
+                                 old_cut[params->py+1 + coords[1]],
+                                 old_cut[params->py+1 + coords[1]+1]-1, &recvcounts[pp]);
+    displs[pp] = 0;
+  }
+  MPI_Alltoallw(sendbuf, sendcounts, displs, sendtypes,
+                recvbuf, recvcounts, displs, recvtypes, comm);
+
+  for(kk=0;kk<nplanes;kk++) {
+    for(ii=0;ii<params->local_ny;ii++) {
+      for(jj=0;jj<params->local_nx;jj++) {
+        *speed(params->width, kk<NSPEEDS ? *cells_ptr : *tmp_cells_ptr, ii+1, jj+1, kk%NSPEEDS) =
+          recvbuf[kk*n + ii*params->local_nx + jj];
+      }
+    }
+  }
+
+  for(pp=0;pp<nprocs;pp++) {
+    if(sendcounts[pp]) MPI_Type_free(&sendtypes[pp]);
+    if(recvcounts[pp]) MPI_Type_free(&recvtypes[pp]);
+  }
+  free(sendtypes);
+  free(sendcounts);
+  free(sendbuf);
+  free(recvbuf);
+  free(old_cut);
 }
 
-float av_velocity(const t_param params, t_speed* cells, int* obstacles)
+float local_velocity(const t_param params, t_speed* cells, unsigned char* obstacles)
 {
   int    ii,jj,kk;       /* generic counters */
-  int    tot_cells = 0;  /* no. of cells used in calculation */
   /* total density in cell */
-  float tot_u_x;        /* accumulated x-components of velocity */
+  float l_tot_u_x;      /* accumulated x-components on this rank */
   float local_density;
+  float f[NSPEEDS];     /* densities in the cell */
   /* initialise */
-  tot_u_x = 0.0;
-  //#pragma omp parallel for private(jj, kk, local_density) reduction(+:tot_u_x, tot_cells)
-  
-
+  l_tot_u_x = 0.0;
 
-  /* loop over all non-blocked cells */
-  for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
-              if(!obstacles[ii*params.nx + jj]) {
+  /* loop over all non-blocked owned cells */
+  #pragma omp parallel for private(jj,kk,local_density,f) reduction(+:l_tot_u_x) schedule(static)
+  for(ii=1;ii<=params.local_ny;ii++) {
+    for(jj=1;jj<=params.local_nx;jj++) {
+              if(!obstacles[ii*params.width + jj]) {
               local_density= 0.0;
               for(kk=0;kk<NSPEEDS;kk++) {
-                local_density += cells[ii*params.nx + jj].speeds[kk];
+                f[kk] = *speed(params.width,cells,ii,jj,kk);
+                local_density += f[kk];
               }
-      
-              tot_u_x += (cells[ii*params.nx + jj].speeds[1] + 
-                    cells[ii*params.nx + jj].speeds[5] + 
-                    cells[ii*params.nx + jj].speeds[8]
-                    - (cells[ii*params.nx + jj].speeds[3] + 
-                       cells[ii*params.nx + jj].speeds[6] + 
-                       cells[ii*params.nx + jj].speeds[7])) / 
-                local_density;
 
-              tot_cells+=1;
+              l_tot_u_x += (f[1] + f[5] + f[8]
+                    - (f[3] + f[6] + f[7])) /
+                local_density;
             }
-          
+
     }
   }
 
-  return tot_u_x / (float)tot_cells;
+  return l_tot_u_x;
 }
 
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles)
+float av_velocity(const t_param params, t_speed* cells, unsigned char* obstacles)
+{
+  float l_tot_u_x;      /* accumulated x-components on this rank */
+  float tot_u_x;        /* accumulated x-components of velocity */
+
+  l_tot_u_x = local_velocity(params,cells,obstacles);
+  MPI_Reduce(&l_tot_u_x, &tot_u_x, 1, MPI_FLOAT, MPI_SUM, MASTER, comm);
+  if(rank!=MASTER) return 0.0;
+
+  return tot_u_x / (float)params.tot_cells;
+}
+
+float calc_reynolds(const t_param params, t_speed* cells, unsigned char* obstacles)
 {
   const float viscosity = 1.0 / 6.0 * (2.0 / params.omega - 1.0);
-  
+
   return av_velocity(params,cells,obstacles) * params.reynolds_dim / viscosity;
 }
 
@@ -991,36 +2544,32 @@ float total_density(const t_param params, t_speed* cells)
   int ii,jj,kk;        /* generic counters */
   float total = 0.0;  /* accumulator */
 
-  for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
+  #pragma omp parallel for private(jj,kk) reduction(+:total) schedule(static)
+  for(ii=1;ii<=params.local_ny;ii++) {
+    for(jj=1;jj<=params.local_nx;jj++) {
       for(kk=0;kk<NSPEEDS;kk++) {
-  total += cells[ii*params.nx + jj].speeds[kk];
+  total += *speed(params.width,cells,ii,jj,kk);
       }
     }
   }
-  
+
   return total;
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+/* the velocity and pressure of cell jj of row, which holds the
+** densities of part of a row as row->speeds[kk][jj] */
+static void cell_state(const t_param params, t_speed* row, int jj, int obstacle,
+                       float* u_x_ptr, float* u_y_ptr, float* pressure_ptr)
 {
-  FILE* fp;                     /* file pointer */
-  int ii,jj,kk;                 /* generic counters */
+  int kk;                      /* generic counter */
   const float c_sq = 1.0/3.0;  /* sq. of speed of sound */
   float local_density;         /* per grid cell sum of densities */
   float pressure;              /* fluid pressure in grid cell */
   float u_x;                   /* x-component of velocity in grid cell */
   float u_y;                   /* y-component of velocity in grid cell */
 
-  fp = fopen(FINALSTATEFILE,"w");
-  if (fp == NULL) {
-    die("could not open file output file",__LINE__,__FILE__);
-  }
-
-  for(ii=0;ii<params.ny;ii++) {
-    for(jj=0;jj<params.nx;jj++) {
       /* an occupied cell */
-      if(obstacles[ii*params.nx + jj]) {
+      if(obstacle) {
   u_x = u_y = 0.0;
   pressure = params.density * c_sq;
       }
@@ -1028,57 +2577,847 @@ int write_values(const t_param params, t_speed* cells, int* obstacles, float* av
       else {
   local_density = 0.0;
   for(kk=0;kk<NSPEEDS;kk++) {
-    local_density += cells[ii*params.nx + jj].speeds[kk];
+    local_density += row->speeds[kk][jj];
   }
   /* compute x velocity component */
-  u_x = (cells[ii*params.nx + jj].speeds[1] + 
-         cells[ii*params.nx + jj].speeds[5] +
-         cells[ii*params.nx + jj].speeds[8]
-         - (cells[ii*params.nx + jj].speeds[3] + 
-      cells[ii*params.nx + jj].speeds[6] + 
-      cells[ii*params.nx + jj].speeds[7]))
+  u_x = (row->speeds[1][jj] +
+         row->speeds[5][jj] +
+         row->speeds[8][jj]
+         - (row->speeds[3][jj] +
+      row->speeds[6][jj] +
+      row->speeds[7][jj]))
     / local_density;
   /* compute y velocity component */
-  u_y = (cells[ii*params.nx + jj].speeds[2] + 
-         cells[ii*params.nx + jj].speeds[5] + 
-         cells[ii*params.nx + jj].speeds[6]
-         - (cells[ii*params.nx + jj].speeds[4] + 
-      cells[ii*params.nx + jj].speeds[7] + 
-      cells[ii*params.nx + jj].speeds[8]))
+  u_y = (row->speeds[2][jj] +
+         row->speeds[5][jj] +
+         row->speeds[6][jj]
+         - (row->speeds[4][jj] +
+      row->speeds[7][jj] +
+      row->speeds[8][jj]))
     / local_density;
   /* compute pressure */
   pressure = local_density * c_sq;
       }
-      /* write to file */
-      fprintf(fp,"%d %d %.12E %.12E %.12E %d\n",ii,jj,u_x,u_y,pressure,obstacles[ii*params.nx + jj]);
+
+  *u_x_ptr = u_x;
+  *u_y_ptr = u_y;
+  *pressure_ptr = pressure;
+}
+
+/* print part of a row of the final state into text, ii being its
+** global row index, start_x its first global column and
+** row->speeds[kk][0..n-1] the densities of its n cells; returns the
+** no. of characters, at most n*CELL_CHARS */
+static int format_row(char* text, const t_param params, int ii, int start_x, int n,
+                      t_speed* row, unsigned char* obstacles_row)
+{
+  int jj;                       /* generic counter */
+  int len = 0;                  /* characters so far */
+  float pressure;              /* fluid pressure in grid cell */
+  float u_x;                   /* x-component of velocity in grid cell */
+  float u_y;                   /* y-component of velocity in grid cell */
+
+  for(jj=0;jj<n;jj++) {
+    cell_state(params, row, jj, obstacles_row[jj], &u_x, &u_y, &pressure);
+    len += sprintf(text+len,"%d %d %.12E %.12E %.12E %d\n",ii,start_x+jj,u_x,u_y,pressure,obstacles_row[jj]);
+  }
+
+  return len;
+}
+
+/* copy the owned part of local row ii into row->speeds[kk][0..local_nx-1]
+** and obstacles_row, in the natural layout */
+static void pack_row(const t_param params, t_speed* cells, unsigned char* obstacles, int ii,
+                     t_speed* row, unsigned char* obstacles_row)
+{
+  int jj,kk;   /* generic counters */
+
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(jj=0;jj<params.local_nx;jj++) row->speeds[kk][jj] = *speed(params.width,cells,ii,jj+1,kk);
+  }
+  for(jj=0;jj<params.local_nx;jj++) obstacles_row[jj] = obstacles[ii*params.width + jj+1];
+}
+
+/* the block of a global ny*nx plane of etype owned by this rank */
+static MPI_Datatype block_type(const t_param params, MPI_Datatype etype)
+{
+  MPI_Datatype block;
+  int sizes[2],subsizes[2],starts[2];  /* of the grid and the block, y first */
+
+  sizes[0] = params.ny;          sizes[1] = params.nx;
+  subsizes[0] = params.local_ny; subsizes[1] = params.local_nx;
+  starts[0] = params.start;      starts[1] = params.start_x;
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, etype, &block);
+  MPI_Type_commit(&block);
+
+  return block;
+}
+
+/* the checkpoint is written to a scratch file which the master only
+** renames over the last one once all the ranks have closed it, so a
+** job killed part way through leaves the previous one intact */
+int write_checkpoint(const t_param params, t_speed* cells, int iters, long long av_bytes)
+{
+  MPI_File fh;                  /* the checkpoint, opened by all ranks */
+  MPI_Datatype block;           /* this rank's block of a plane */
+  t_check_header header;        /* written by the master */
+  int ii,jj,kk;                 /* generic counters */
+  int n;                        /* no. of owned cells */
+  float* buffer;                /* their densities, plane by plane */
+
+  n = params.local_ny*params.local_nx;
+  buffer = (float*)malloc(sizeof(float)*NSPEEDS*n);
+  if (buffer == NULL)
+    die("cannot allocate memory for checkpoint",__LINE__,__FILE__);
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(ii=0;ii<params.local_ny;ii++) {
+      for(jj=0;jj<params.local_nx;jj++) {
+        buffer[kk*n + ii*params.local_nx + jj] = *speed(params.width,cells,ii+1,jj+1,kk);
+      }
     }
   }
+  block = block_type(params, MPI_FLOAT);
 
-  fclose(fp);
+  if(MPI_File_open(comm, CHECKPOINTTMP, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+                   MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    die("could not open checkpoint file",__LINE__,__FILE__);
+  }
+  MPI_File_set_size(fh, 0);
+  if(rank==MASTER) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECK_MAGIC, sizeof(header.magic));
+    header.nx = params.nx;
+    header.ny = params.ny;
+    header.iters = iters;
+    header.av_bytes = av_bytes;
+    MPI_File_write_at(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+  }
 
-  fp = fopen(AVVELSFILE,"w");
-  if (fp == NULL) {
+  /* one collective write for each plane */
+  for(kk=0;kk<NSPEEDS;kk++) {
+    MPI_File_set_view(fh, sizeof(header) + (MPI_Offset)kk*params.nx*params.ny*sizeof(float),
+                      MPI_FLOAT, block, "native", MPI_INFO_NULL);
+    if(MPI_File_write_all(fh, &buffer[kk*n], n, MPI_FLOAT, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+      die("could not write checkpoint",__LINE__,__FILE__);
+    }
+  }
+  MPI_File_close(&fh);
+
+  if(rank==MASTER && rename(CHECKPOINTTMP, CHECKPOINTFILE) != 0)
+    die("could not rename checkpoint file",__LINE__,__FILE__);
+  MPI_Barrier(comm);
+
+  MPI_Type_free(&block);
+  free(buffer);
+
+  return EXIT_SUCCESS;
+}
+
+int read_checkpoint(const t_param params, t_speed* cells, int* iters, long long* av_bytes)
+{
+  MPI_File fh;                  /* the checkpoint, opened by all ranks */
+  MPI_Datatype block;           /* this rank's block of a plane */
+  t_check_header header;
+  int ii,jj,kk;                 /* generic counters */
+  int n;                        /* no. of owned cells */
+  float* buffer;                /* their densities, plane by plane */
+
+  if(MPI_File_open(comm, CHECKPOINTFILE, MPI_MODE_RDONLY,
+                   MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    die("could not open checkpoint file",__LINE__,__FILE__);
+  }
+  if(MPI_File_read_at_all(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS ||
+     memcmp(header.magic, CHECK_MAGIC, sizeof(header.magic)) != 0)
+    die("not a checkpoint file",__LINE__,__FILE__);
+  if(header.nx != params.nx || header.ny != params.ny)
+    die("checkpoint is for a different grid",__LINE__,__FILE__);
+  if(header.iters > params.maxIters)
+    die("checkpoint is past maxIters",__LINE__,__FILE__);
+
+  n = params.local_ny*params.local_nx;
+  buffer = (float*)malloc(sizeof(float)*NSPEEDS*n);
+  if (buffer == NULL)
+    die("cannot allocate memory for checkpoint",__LINE__,__FILE__);
+  block = block_type(params, MPI_FLOAT);
+  for(kk=0;kk<NSPEEDS;kk++) {
+    MPI_File_set_view(fh, sizeof(header) + (MPI_Offset)kk*params.nx*params.ny*sizeof(float),
+                      MPI_FLOAT, block, "native", MPI_INFO_NULL);
+    if(MPI_File_read_all(fh, &buffer[kk*n], n, MPI_FLOAT, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+      die("could not read checkpoint",__LINE__,__FILE__);
+    }
+  }
+  MPI_File_close(&fh);
+
+  /* the halos are filled in by the exchange at the start of a step */
+  cells->swapped = FALSE;
+  for(kk=0;kk<NSPEEDS;kk++) {
+    for(ii=0;ii<params.local_ny;ii++) {
+      for(jj=0;jj<params.local_nx;jj++) {
+        cells->speeds[kk][(ii+1)*params.width + jj+1] = buffer[kk*n + ii*params.local_nx + jj];
+      }
+    }
+  }
+
+  MPI_Type_free(&block);
+  free(buffer);
+
+  *iters = header.iters;
+  *av_bytes = header.av_bytes;
+
+  return EXIT_SUCCESS;
+}
+
+/* write the final state as planes of raw values, see t_state_header */
+static int write_binary(const t_param params, t_speed* cells, unsigned char* obstacles)
+{
+  MPI_File fh;                  /* the final state file, opened by all ranks */
+  MPI_Datatype block[2];        /* this rank's block of a float / byte plane */
+  MPI_Offset plane;             /* no. of cells in a plane */
+  t_state_header header;        /* written by the master */
+  int ii,jj,kk;                 /* generic counters */
+  int n;                        /* no. of owned cells */
+  float* fields;                /* u_x, u_y & pressure of the owned cells */
+  unsigned char* blocked;       /* and their obstacles */
+  float* buffer;                /* a row, packed speed by speed */
+  t_speed row;                  /* planes of that row */
+  unsigned char* obstacles_row; /* and its obstacles */
+
+  n = params.local_ny*params.local_nx;
+  fields = (float*)malloc(sizeof(float)*3*n);
+  blocked = (unsigned char*)malloc(n);
+  buffer = (float*)malloc(sizeof(float)*NSPEEDS*params.local_nx);
+  obstacles_row = (unsigned char*)malloc(params.local_nx);
+  if (fields == NULL || blocked == NULL || buffer == NULL || obstacles_row == NULL)
+    die("cannot allocate memory for output",__LINE__,__FILE__);
+  row.swapped = FALSE;
+  row.index = NULL;
+  for(kk=0;kk<NSPEEDS;kk++) row.speeds[kk] = buffer + kk*params.local_nx;
+
+  for(ii=0;ii<params.local_ny;ii++) {
+    pack_row(params, cells, obstacles, ii+1, &row, obstacles_row);
+    for(jj=0;jj<params.local_nx;jj++) {
+      kk = ii*params.local_nx + jj;
+      cell_state(params, &row, jj, obstacles_row[jj],
+                 &fields[kk], &fields[n+kk], &fields[2*n+kk]);
+      blocked[kk] = obstacles_row[jj];
+    }
+  }
+
+  block[0] = block_type(params, MPI_FLOAT);
+  block[1] = block_type(params, MPI_UNSIGNED_CHAR);
+
+  if(MPI_File_open(comm, FINALSTATEBIN, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+                   MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
     die("could not open file output file",__LINE__,__FILE__);
   }
-  for (ii=0;ii<params.maxIters;ii++) {
-    fprintf(fp,"%d:\t%.12E\n", ii, av_vels[ii]);
+  MPI_File_set_size(fh, 0);
+  if(rank==MASTER) {
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.nx = params.nx;
+    header.ny = params.ny;
+    header.dtype = sizeof(float);
+    MPI_File_write_at(fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
   }
 
-  fclose(fp);
+  /* one collective write for each plane */
+  plane = (MPI_Offset)params.nx*params.ny;
+  for(kk=0;kk<4;kk++) {
+    MPI_File_set_view(fh, sizeof(header) + kk*plane*sizeof(float),
+                      kk<3 ? MPI_FLOAT : MPI_UNSIGNED_CHAR, block[kk<3 ? 0 : 1],
+                      "native", MPI_INFO_NULL);
+    if((kk<3 ? MPI_File_write_all(fh, &fields[kk*n], n, MPI_FLOAT, MPI_STATUS_IGNORE)
+             : MPI_File_write_all(fh, blocked, n, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE))
+       != MPI_SUCCESS) {
+      die("could not write the final state",__LINE__,__FILE__);
+    }
+  }
+  MPI_File_close(&fh);
+
+  MPI_Type_free(&block[0]);
+  MPI_Type_free(&block[1]);
+  free(fields);
+  free(blocked);
+  free(buffer);
+  free(obstacles_row);
+
+  return EXIT_SUCCESS;
+}
+
+int write_values(const t_param params, t_speed* cells, unsigned char* obstacles)
+{
+  MPI_File fh;                  /* the final state file, opened by all ranks */
+  MPI_Datatype filetype;        /* where this rank's rows go in it */
+  MPI_Comm row_comm;            /* the ranks sharing this rank's rows */
+  MPI_Comm col_comm;            /* and those sharing its columns */
+  int remain[2];                /* axes kept in a sub-communicator */
+  int ii,kk;                    /* generic counters */
+  char* text;                   /* this rank's part of the file */
+  int len;                      /* no. of characters in it */
+  int* lengths;                 /* of each of its rows */
+  long long* before;            /* characters of a row left of this rank */
+  long long* row_len;           /* characters of the whole row */
+  long long block_start;        /* offset of this rank's first row */
+  MPI_Aint* offsets;            /* of each of its parts of a row */
+  float* buffer;                /* a row, packed speed by speed */
+  t_speed row;                  /* planes of that row */
+  unsigned char* obstacles_row; /* and its obstacles */
+
+  if(params.output == OUTPUT_BINARY) return write_binary(params, cells, obstacles);
+
+  text = (char*)malloc((size_t)params.local_ny*params.local_nx*CELL_CHARS);
+  lengths = (int*)malloc(sizeof(int)*params.local_ny);
+  before = (long long*)malloc(sizeof(long long)*params.local_ny);
+  row_len = (long long*)malloc(sizeof(long long)*params.local_ny);
+  offsets = (MPI_Aint*)malloc(sizeof(MPI_Aint)*params.local_ny);
+  buffer = (float*)malloc(sizeof(float)*NSPEEDS*params.local_nx);
+  obstacles_row = (unsigned char*)malloc(params.local_nx);
+  if (text == NULL || lengths == NULL || before == NULL || row_len == NULL ||
+      offsets == NULL || buffer == NULL || obstacles_row == NULL)
+    die("cannot allocate memory for output",__LINE__,__FILE__);
+  row.swapped = FALSE;
+  row.index = NULL;
+  for(kk=0;kk<NSPEEDS;kk++) row.speeds[kk] = buffer + kk*params.local_nx;
+
+  /* every rank prints its own block; the lines are not all the same
+  ** length, so the offsets are only known after that */
+  len = 0;
+  for(ii=1;ii<=params.local_ny;ii++) {
+    pack_row(params, cells, obstacles, ii, &row, obstacles_row);
+    lengths[ii-1] = format_row(text+len, params, params.start+ii-1, params.start_x,
+                               params.local_nx, &row, obstacles_row);
+    before[ii-1] = lengths[ii-1];
+    len += lengths[ii-1];
+  }
+
+  /* a global row is made of the parts of the ranks across x, in
+  ** order, and the blocks of rows follow each other in the order of
+  ** the ranks across y; the sub-communicators rank them the same way */
+  remain[0] = FALSE; remain[1] = TRUE;
+  MPI_Cart_sub(comm, remain, &row_comm);
+  remain[0] = TRUE; remain[1] = FALSE;
+  MPI_Cart_sub(comm, remain, &col_comm);
+
+  MPI_Allreduce(before, row_len, params.local_ny, MPI_LONG_LONG, MPI_SUM, row_comm);
+  MPI_Exscan(MPI_IN_PLACE, before, params.local_ny, MPI_LONG_LONG, MPI_SUM, row_comm);
+  if(params.start_x == 0) {
+    for(ii=0;ii<params.local_ny;ii++) before[ii] = 0;
+  }
+  block_start = 0;
+  for(ii=0;ii<params.local_ny;ii++) block_start += row_len[ii];
+  MPI_Exscan(MPI_IN_PLACE, &block_start, 1, MPI_LONG_LONG, MPI_SUM, col_comm);
+  if(params.start == 0) block_start = 0;
+
+  for(ii=0;ii<params.local_ny;ii++) {
+    offsets[ii] = (MPI_Aint)(block_start + before[ii]);
+    block_start += row_len[ii];
+  }
+  MPI_Type_create_hindexed(params.local_ny, lengths, offsets, MPI_CHAR, &filetype);
+  MPI_Type_commit(&filetype);
+
+  /* and they all write their parts of the file at once */
+  if(MPI_File_open(comm, FINALSTATEFILE, MPI_MODE_CREATE|MPI_MODE_WRONLY,
+                   MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    die("could not open file output file",__LINE__,__FILE__);
+  }
+  MPI_File_set_size(fh, 0);
+  MPI_File_set_view(fh, 0, MPI_CHAR, filetype, "native", MPI_INFO_NULL);
+  if(MPI_File_write_all(fh, text, len, MPI_CHAR, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+    die("could not write the final state",__LINE__,__FILE__);
+  }
+  MPI_File_close(&fh);
+
+  MPI_Type_free(&filetype);
+  MPI_Comm_free(&row_comm);
+  MPI_Comm_free(&col_comm);
+  free(text);
+  free(lengths);
+  free(before);
+  free(row_len);
+  free(offsets);
+  free(buffer);
+  free(obstacles_row);
 
   return EXIT_SUCCESS;
 }
 
+void write_timings(const t_param params, double elapsed, int iters)
+{
+  FILE*   fp;                   /* the report */
+  double* all = NULL;           /* the phase times, rank by rank */
+  double* busy = NULL;          /* the total of each rank */
+  double  lo,hi,mean;           /* over the ranks */
+  int     threads = 1;          /* per rank */
+  int     coords[2];            /* of a rank, y first */
+  int     ii,pp;                /* generic counters */
+
+  if(rank==MASTER) {
+    all = (double*)malloc(sizeof(double)*NPHASES*nprocs);
+    busy = (double*)calloc(nprocs, sizeof(double));
+    if (all == NULL || busy == NULL)
+      die("cannot allocate memory for the timings",__LINE__,__FILE__);
+  }
+  MPI_Gather(phase_time, NPHASES, MPI_DOUBLE, all, NPHASES, MPI_DOUBLE, MASTER, comm);
+  if(rank!=MASTER) return;
+
+  fp = fopen(params.timing, "w");
+  if (fp == NULL)
+    die("could not open the timing report",__LINE__,__FILE__);
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"nx\": %d, \"ny\": %d, \"fluid_cells\": %d, \"iters\": %d,\n",
+          params.nx, params.ny, params.tot_cells, iters);
+  fprintf(fp, "  \"kernel\": \"%s\", \"ranks\": %d, \"px\": %d, \"py\": %d, \"threads\": %d,\n",
+          kernel_names[params.kernel], nprocs, params.px, params.py, threads);
+  fprintf(fp, "  \"elapsed\": %.6f,\n", elapsed);
+  /* lattice updates per second, of all the cells and of the fluid ones */
+  fprintf(fp, "  \"mlups\": %.3f, \"mflups\": %.3f,\n",
+          elapsed > 0.0 ? (double)params.nx*params.ny*iters / elapsed / 1.0e6 : 0.0,
+          elapsed > 0.0 ? (double)params.tot_cells*iters / elapsed / 1.0e6 : 0.0);
+  fprintf(fp, "  \"coords\": [");
+  for(pp=0;pp<nprocs;pp++) {
+    MPI_Cart_coords(comm, pp, 2, coords);
+    fprintf(fp, "%s[%d, %d]", pp ? ", " : "", coords[1], coords[0]);
+  }
+  fprintf(fp, "],\n");
+
+  /* one entry per phase, then their total per rank */
+  fprintf(fp, "  \"phases\": {\n");
+  for(ii=0;ii<=NPHASES;ii++) {
+    lo = hi = mean = 0.0;
+    for(pp=0;pp<nprocs;pp++) {
+      const double t = (ii < NPHASES) ? all[pp*NPHASES + ii] : busy[pp];
+      if(ii < NPHASES) busy[pp] += t;
+      if(pp == 0 || t < lo) lo = t;
+      if(pp == 0 || t > hi) hi = t;
+      mean += t / nprocs;
+    }
+    fprintf(fp, "    \"%s\": { \"min\": %.6f, \"avg\": %.6f, \"max\": %.6f, \"imbalance\": %.3f,\n",
+            (ii < NPHASES) ? phase_names[ii] : "total", lo, mean, hi, mean > 0.0 ? hi/mean : 1.0);
+    fprintf(fp, "      \"ranks\": [");
+    for(pp=0;pp<nprocs;pp++)
+      fprintf(fp, "%s%.6f", pp ? ", " : "", (ii < NPHASES) ? all[pp*NPHASES + ii] : busy[pp]);
+    fprintf(fp, "] }%s\n", (ii < NPHASES) ? "," : "");
+  }
+  fprintf(fp, "  }\n");
+  fprintf(fp, "}\n");
+
+  fclose(fp);
+  free(all);
+  free(busy);
+}
+
+void write_av_vel(FILE* fp, const t_param params, MPI_Request* request,
+                  int step, float* sum)
+{
+  MPI_Wait(request, MPI_STATUS_IGNORE);
+  if(rank==MASTER && step >= 0) {
+    fprintf(fp,"%d:\t%.12E\n", step, *sum / (float)params.tot_cells);
+  }
+}
+
+/* open the counters of every thread, or none of them; FALSE where
+** the kernel will not give them to us (see perf_event_paranoid) */
+static int counters_open(int* fd, int nthreads)
+{
+  int ok = TRUE;   /* whether all of them opened */
+  int cc;          /* counter */
+
+  for(cc=0;cc<nthreads*NCOUNTERS;cc++) fd[cc] = -1;
+#ifdef __linux__
+  /* a counter follows the thread that opens it */
+  #pragma omp parallel private(cc) reduction(&&:ok)
+  {
+    static const unsigned long long config[NCOUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+    };
+    struct perf_event_attr attr;
+    int tt = 0;   /* this thread */
+#ifdef _OPENMP
+    tt = omp_get_thread_num();
+#endif
+    for(cc=0;cc<NCOUNTERS;cc++) {
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[cc];
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd[tt*NCOUNTERS + cc] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if(fd[tt*NCOUNTERS + cc] < 0) ok = FALSE;
+    }
+  }
+#else
+  ok = FALSE;
+#endif
+  if(!ok) {
+    for(cc=0;cc<nthreads*NCOUNTERS;cc++) {
+      if(fd[cc] >= 0) close(fd[cc]);
+      fd[cc] = -1;
+    }
+  }
+
+  return ok;
+}
+
+/* zero and start the counters, then stop them and sum them over the threads */
+static void counters_start(int* fd, int nthreads)
+{
+#ifdef __linux__
+  int cc;   /* counter */
+
+  for(cc=0;cc<nthreads*NCOUNTERS;cc++) {
+    ioctl(fd[cc], PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd[cc], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static void counters_stop(int* fd, int nthreads, long long counts[NCOUNTERS])
+{
+  long long value;   /* of one thread's counter */
+  int cc;            /* counter */
+
+  for(cc=0;cc<NCOUNTERS;cc++) counts[cc] = 0;
+#ifdef __linux__
+  for(cc=0;cc<nthreads*NCOUNTERS;cc++) ioctl(fd[cc], PERF_EVENT_IOC_DISABLE, 0);
+  for(cc=0;cc<nthreads*NCOUNTERS;cc++) {
+    if(read(fd[cc], &value, sizeof(value)) == sizeof(value)) counts[cc % NCOUNTERS] += value;
+  }
+#endif
+}
+
+/* run benchmark bench reps times over */
+static void bench_run(const t_param params, int bench, int reps, t_speed* cells, t_speed* tmp_cells,
+                      unsigned char* obstacles, float* triad, int nfloats)
+{
+  float* a = triad;               /* STREAM's arrays */
+  float* b = triad + nfloats;
+  float* c = triad + 2*nfloats;
+  int    ii,rr;                   /* generic counters */
+
+  for(rr=0;rr<reps;rr++) {
+    switch(bench) {
+      case BENCH_TRIAD:
+        #pragma omp parallel for schedule(static)
+        for(ii=0;ii<nfloats;ii++) a[ii] = b[ii] + 3.0f*c[ii];
+        break;
+      case BENCH_PROPAGATE:
+        propagate(params,cells,tmp_cells,obstacles);
+        break;
+      case BENCH_REBOUND:
+        rebound(cells,tmp_cells);
+        break;
+      case BENCH_COLLISION:
+        collision(params,cells,tmp_cells,obstacles);
+        break;
+      case BENCH_FUSED:
+        stream_collide(params,cells,tmp_cells,obstacles,1,params.local_ny,1,params.local_nx);
+        break;
+      case BENCH_HALO:
+        halo_start(params,cells,&halo);
+        halo_finish(params,cells,&halo);
+        break;
+    }
+  }
+}
+
+void microbench(t_param* params)
+{
+  t_speed* cells = NULL;       /* grid containing fluid densities */
+  t_speed* tmp_cells = NULL;   /* scratch space */
+  unsigned char* obstacles = NULL;  /* grid indicating which cells are blocked */
+  float*   triad;              /* STREAM's three arrays, one after the other */
+  int      nfloats;            /* in each of them */
+  int*     fd;                 /* the counters of each thread */
+  int      counting;           /* whether the counters could be opened */
+  long long counts[NCOUNTERS]; /* over the last timed runs of a benchmark */
+  int      nthreads = 1;       /* OpenMP threads */
+  double   bytes[NBENCH];      /* moved by one run of each benchmark */
+  double   flops[NBENCH];      /* and computed */
+  double   seconds;            /* taken by the last timed runs */
+  double   triad_rate = 0.0;   /* bytes per second of the triad */
+  double   working_set;        /* bytes of the lattices and obstacles, halos included */
+  double   tic;                /* start of those runs */
+  int      reps;               /* no. of them */
+  int      dims[2] = { 1, 1 };
+  int      periods[2] = { TRUE, TRUE };
+  int      size;               /* of the grid, size*size cells */
+  int      nfluid;             /* fluid cells of the grid */
+  int      nlinks;             /* speeds rebound() copies */
+  int      bb,ii,jj,kk;        /* generic counters */
+
+  if(nprocs != 1)
+    die("the microbenchmarks run on a single rank",__LINE__,__FILE__);
+
+  /* one rank, which is its own neighbour all round, with the three
+  ** separate kernels and the usual inputs */
+  MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, TRUE, &comm);
+  MPI_Comm_rank(comm, &rank);
+  for(kk=0;kk<NSPEEDS;kk++) neighbour[kk] = rank;
+  params->px = params->py = 1;
+  params->kernel = KERNEL_SPLIT;
+  params->depth = 1;
+  params->balance = BALANCE_EVEN;
+  params->rebalance_every = 0;
+  params->maxIters = 0;
+  params->density = 0.1;
+  params->accel = 0.005;
+  params->omega = 1.85;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  fd = (int*)malloc(sizeof(int)*nthreads*NCOUNTERS);
+  if (fd == NULL)
+    die("cannot allocate memory for the counters",__LINE__,__FILE__);
+  counting = counters_open(fd, nthreads);
+
+  printf("%d thread(s), %d cell(s) per vector, %s\n", nthreads, VLEN,
+         counting ? "with hardware counters" : "no hardware counters");
+  printf("%6s %9s %-10s %10s %8s %8s %7s %5s %9s\n", "size", "set (KB)", "kernel",
+         "time (us)", "GB/s", "GFLOP/s", "% triad", "IPC", "LLC GB/s");
+
+  for(size=16;size<=params->microbench;size*=2) {
+    params->nx = params->ny = params->reynolds_dim = size;
+
+    /* a channel walled top and bottom, around a square obstacle */
+    obstacle_map = (unsigned char*)calloc((size_t)size*size, 1);
+    if (obstacle_map == NULL)
+      die("cannot allocate memory for the obstacle map",__LINE__,__FILE__);
+    for(jj=0;jj<size;jj++) {
+      obstacle_map[jj] = 1;
+      obstacle_map[(size_t)(size-1)*size + jj] = 1;
+    }
+    for(ii=3*size/8;ii<5*size/8;ii++) {
+      for(jj=3*size/8;jj<5*size/8;jj++) obstacle_map[(size_t)ii*size + jj] = 1;
+    }
+    nfluid = 0;
+    for(ii=0;ii<size*size;ii++) nfluid += !obstacle_map[ii];
+    params->tot_cells = nfluid;
+
+    partition(params, obstacle_map);
+    build_block(params, &cells, &tmp_cells, &obstacles);
+    nlinks = 0;
+    for(kk=1;kk<NSPEEDS;kk++) nlinks += boundary.count[kk];
+
+    /* what the kernels of a step sweep over: the nine float planes of
+    ** cells and tmp_cells and the byte-per-cell obstacle map, each
+    ** (local_ny+2*depth)*width cells including the frame of halos */
+    working_set = (2.0*NSPEEDS*sizeof(float) + 1.0)
+                * (params->local_ny + 2*params->depth)*params->width;
+
+    /* as many bytes as the two lattices, first touched by the
+    ** threads that sweep them */
+    nfloats = 2*NSPEEDS*size*size/3;
+    triad = (float*)malloc(sizeof(float)*3*nfloats);
+    if (triad == NULL)
+      die("cannot allocate memory for the triad",__LINE__,__FILE__);
+    #pragma omp parallel for schedule(static)
+    for(ii=0;ii<3*nfloats;ii++) triad[ii] = 1.0f;
+
+    /* the compulsory traffic of each kernel, counting every float
+    ** read or written once; the halo exchange copies every density
+    ** streaming across the sides out of the block and into the halos */
+    bytes[BENCH_TRIAD] = 3.0*sizeof(float)*nfloats;
+    flops[BENCH_TRIAD] = 2.0*nfloats;
+    bytes[BENCH_PROPAGATE] = 2.0*NSPEEDS*sizeof(float)*size*size;
+    flops[BENCH_PROPAGATE] = 0.0;
+    bytes[BENCH_REBOUND] = (double)(sizeof(int) + 2*sizeof(float))*nlinks;
+    flops[BENCH_REBOUND] = 0.0;
+    bytes[BENCH_COLLISION] = (2.0*NSPEEDS*sizeof(float) + 1.0)*size*size;
+    flops[BENCH_COLLISION] = (double)COLLIDE_FLOPS*nfluid;
+    bytes[BENCH_FUSED] = bytes[BENCH_COLLISION];
+    flops[BENCH_FUSED] = flops[BENCH_COLLISION];
+    bytes[BENCH_HALO] = 2.0*sizeof(float)*(3*4*size + 4);
+    flops[BENCH_HALO] = 0.0;
+
+    for(bb=0;bb<NBENCH;bb++) {
+      /* once to warm up, then twice as many times until long enough to time */
+      bench_run(*params, bb, 1, cells, tmp_cells, obstacles, triad, nfloats);
+      for(reps=1;;reps*=2) {
+        tic = MPI_Wtime();
+        if(counting) counters_start(fd, nthreads);
+        bench_run(*params, bb, reps, cells, tmp_cells, obstacles, triad, nfloats);
+        if(counting) counters_stop(fd, nthreads, counts);
+        seconds = MPI_Wtime() - tic;
+        if(seconds >= BENCH_SECONDS) break;
+      }
+      if(bb == BENCH_TRIAD) triad_rate = bytes[bb]*reps/seconds;
+
+      printf("%6d %9.0f %-10s %10.3f %8.2f %8.2f %7.0f", size, working_set/1024.0,
+             bench_names[bb], 1.0e6*seconds/reps, 1.0e-9*bytes[bb]*reps/seconds,
+             1.0e-9*flops[bb]*reps/seconds, 100.0*bytes[bb]*reps/seconds/triad_rate);
+      if(counting && counts[COUNTER_CYCLES] > 0)
+        printf(" %5.2f %9.2f\n", (double)counts[COUNTER_INSTRUCTIONS]/counts[COUNTER_CYCLES],
+               1.0e-9*LINE_BYTES*counts[COUNTER_LLC_MISSES]/seconds);
+      else
+        printf(" %5s %9s\n", "-", "-");
+    }
+    fflush(stdout);
+
+    free(triad);
+    free_block(params, &cells, &tmp_cells, &obstacles);
+    free(obstacle_map);
+    obstacle_map = NULL;
+    free(row_cut);
+    free(col_cut);
+  }
+
+  if(counting) {
+    for(ii=0;ii<nthreads*NCOUNTERS;ii++) close(fd[ii]);
+  }
+  free(fd);
+  MPI_Comm_free(&comm);
+}
+
+void parse_args(int argc, char* argv[], t_param* params,
+         char** paramfile_ptr, char** obstaclefile_ptr)
+{
+  int ii;  /* argument counter */
+
+  /* defaults */
+  params->kernel = KERNEL_FUSED;
+  params->px = params->py = 0;
+  params->diag_every = 1;
+  params->output = OUTPUT_TEXT;
+  params->checkpoint_every = 0;
+  params->restart = FALSE;
+  params->depth = 4;
+  params->balance = BALANCE_EVEN;
+  params->rebalance_every = 0;
+  params->timing = NULL;
+  params->microbench = 0;
+
+  for(ii=1;ii<argc && strncmp(argv[ii],"--",2)==0;ii++) {
+    if(strcmp(argv[ii],"--kernel")==0 && ii+1<argc) {
+      ii++;
+      if(strcmp(argv[ii],"fused")==0) params->kernel = KERNEL_FUSED;
+      else if(strcmp(argv[ii],"split")==0) params->kernel = KERNEL_SPLIT;
+      else if(strcmp(argv[ii],"aa")==0) params->kernel = KERNEL_AA;
+      else if(strcmp(argv[ii],"sparse")==0) params->kernel = KERNEL_SPARSE;
+      else if(strcmp(argv[ii],"blocked")==0) params->kernel = KERNEL_BLOCKED;
+      else usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--grid")==0 && ii+1<argc) {
+      ii++;
+      if(sscanf(argv[ii],"%dx%d",&(params->px),&(params->py)) != 2 ||
+         params->px < 1 || params->py < 1) usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--balance")==0 && ii+1<argc) {
+      ii++;
+      if(strcmp(argv[ii],"even")==0) params->balance = BALANCE_EVEN;
+      else if(strcmp(argv[ii],"fluid")==0) params->balance = BALANCE_FLUID;
+      else usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--rebalance")==0 && ii+1<argc) {
+      ii++;
+      if(sscanf(argv[ii],"%d",&(params->rebalance_every)) != 1 ||
+         params->rebalance_every < 0) usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--microbench")==0 && ii+1<argc) {
+      ii++;
+      if(sscanf(argv[ii],"%d",&(params->microbench)) != 1 ||
+         params->microbench < 16) usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--timing")==0 && ii+1<argc) {
+      params->timing = argv[++ii];
+    }
+    else if(strcmp(argv[ii],"--output")==0 && ii+1<argc) {
+      ii++;
+      if(strcmp(argv[ii],"text")==0) params->output = OUTPUT_TEXT;
+      else if(strcmp(argv[ii],"binary")==0) params->output = OUTPUT_BINARY;
+      else usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--checkpoint")==0 && ii+1<argc) {
+      ii++;
+      if(sscanf(argv[ii],"%d",&(params->checkpoint_every)) != 1 ||
+         params->checkpoint_every < 0) usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--restart")==0) {
+      params->restart = TRUE;
+    }
+    else if(strcmp(argv[ii],"--steps")==0 && ii+1<argc) {
+      ii++;
+      if(sscanf(argv[ii],"%d",&(params->depth)) != 1 ||
+         params->depth < 1) usage(argv[0]);
+    }
+    else if(strcmp(argv[ii],"--diag")==0 && ii+1<argc) {
+      ii++;
+      if(sscanf(argv[ii],"%d",&(params->diag_every)) != 1 ||
+         params->diag_every < 0) usage(argv[0]);
+    }
+    else {
+      usage(argv[0]);
+    }
+  }
+
+  /* the microbenchmarks make up their own inputs */
+  if(params->microbench > 0) {
+    if(argc-ii != 0) usage(argv[0]);
+    return;
+  }
+
+  /* followed by exactly the two input files */
+  if(argc-ii != 2) usage(argv[0]);
+
+  /* only a time block needs more than one cell of halo */
+  if(params->kernel != KERNEL_BLOCKED) params->depth = 1;
+
+  /* the obstacles of a sparse lattice keep no densities of their
+  ** own, so its state would not fit in a checkpoint */
+  if(params->kernel == KERNEL_SPARSE && (params->checkpoint_every > 0 || params->restart))
+    die("checkpoints need a dense kernel",__LINE__,__FILE__);
+  *paramfile_ptr = argv[ii];
+  *obstaclefile_ptr = argv[ii+1];
+}
+
 void die(const char* message, const int line, const char *file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
   fprintf(stderr, "%s\n",message);
   fflush(stderr);
+  MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   exit(EXIT_FAILURE);
 }
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s [options] <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "       %s --microbench N\n", exe);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --kernel fused|split|aa|sparse|blocked\n");
+  fprintf(stderr, "                            one fused sweep per step (default),\n");
+  fprintf(stderr, "                            separate propagate, rebound & collision,\n");
+  fprintf(stderr, "                            the in-place AA pattern on one grid,\n");
+  fprintf(stderr, "                            a fused sweep over the fluid cells only,\n");
+  fprintf(stderr, "                            or fused sweeps a tile of several steps\n");
+  fprintf(stderr, "                            at a time\n");
+  fprintf(stderr, "  --steps N                 steps per time block of the blocked\n");
+  fprintf(stderr, "                            kernel, and depth of its halos (default 4)\n");
+  fprintf(stderr, "  --grid PXxPY              split the grid over PX ranks across x and\n");
+  fprintf(stderr, "                            PY across y (default: the shortest halos)\n");
+  fprintf(stderr, "  --balance even|fluid      give each row and column of ranks the same\n");
+  fprintf(stderr, "                            no. of cells (default) or of fluid cells\n");
+  fprintf(stderr, "  --rebalance N             every N steps, move the cells between the\n");
+  fprintf(stderr, "                            ranks if their step times drift apart\n");
+  fprintf(stderr, "                            (default 0, never)\n");
+  fprintf(stderr, "  --diag N                  write the average velocity every N steps\n");
+  fprintf(stderr, "                            (default 1, 0 for never)\n");
+  fprintf(stderr, "  --output text|binary      final_state.dat (default), or the raw\n");
+  fprintf(stderr, "                            final_state.bin; see state2txt.c\n");
+  fprintf(stderr, "  --checkpoint N            save the densities to checkpoint.dat\n");
+  fprintf(stderr, "                            every N steps (default 0, never)\n");
+  fprintf(stderr, "  --restart                 carry on from checkpoint.dat, with any\n");
+  fprintf(stderr, "                            no. of ranks\n");
+  fprintf(stderr, "  --timing FILE             write the time each rank spent in each\n");
+  fprintf(stderr, "                            phase to FILE, as JSON\n");
+  fprintf(stderr, "  --microbench N            instead of a run, time each kernel on one\n");
+  fprintf(stderr, "                            rank on grids of 16x16 up to NxN, against\n");
+  fprintf(stderr, "                            the memory bandwidth\n");
+  MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   exit(EXIT_FAILURE);
-} 
\ No newline at end of file
+}
@@ -0,0 +1,124 @@
+/*
+** Write a parameter file and a synthetic obstacle file for a grid
+** of any size, for benchmarking d2q9-bgk.exe without the real
+** inputs, e.g.
+**
+**   gcc -O2 -o makeinputs makeinputs.c
+**   ./makeinputs 1024 512 0.2 1000 input_1024x512.params obstacles_1024x512.dat
+**
+** The channel is walled along its first and last rows, like the
+** usual obstacle files, and round obstacles of a radius of ny/16
+** cells are then scattered over it until the given fraction of the
+** cells is solid.  The obstacles wrap around the edges, as the flow
+** does.  The same seed (the optional last argument) always gives the
+** same file.  Large obstacle files load faster once converted with
+** obstacles2rle.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+
+#define DENSITY         0.1f    /* of the initial flow */
+#define ACCEL           0.005f  /* pushes the flow east through column 0 */
+#define OMEGA           1.85f   /* relaxation parameter */
+
+void die(const char* message, const int line, const char *file);
+
+/* xorshift, to be the same on every machine */
+unsigned int next_random(unsigned int* state);
+
+int main(int argc, char* argv[])
+{
+  FILE* fp;                  /* the file being written */
+  unsigned char* map;        /* the blocked cells of the whole grid */
+  int nx,ny;                 /* grid size */
+  int iters;                 /* no. of steps to run */
+  double solid;              /* fraction of the cells to block */
+  long target;               /* no. of cells to block */
+  long blocked = 0;          /* no. of cells blocked so far */
+  unsigned int seed = 1;     /* of the obstacle positions */
+  int radius;                /* of each obstacle */
+  int xx,yy;                 /* centre of an obstacle */
+  int ii,jj;                 /* generic counters */
+
+  if(argc != 7 && argc != 8) {
+    fprintf(stderr, "Usage: %s <nx> <ny> <solid fraction> <iters> <input.params> <obstacles.dat> [seed]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  nx = atoi(argv[1]);
+  ny = atoi(argv[2]);
+  solid = atof(argv[3]);
+  iters = atoi(argv[4]);
+  if(argc == 8) seed = (unsigned int)strtoul(argv[7], NULL, 10);
+  if(seed == 0) seed = 1;
+  if(nx < 1 || ny < 3) die("bad grid size",__LINE__,__FILE__);
+  if(solid < 0.0 || solid >= 1.0) die("the solid fraction must be in [0,1)",__LINE__,__FILE__);
+  if(iters < 1) die("bad no. of iterations",__LINE__,__FILE__);
+
+  fp = fopen(argv[5],"w");
+  if (fp == NULL) die("could not open parameter file",__LINE__,__FILE__);
+  fprintf(fp,"%d\n%d\n%d\n%d\n%f\n%f\n%f\n", nx, ny, iters, ny, DENSITY, ACCEL, OMEGA);
+  fclose(fp);
+
+  map = (unsigned char*)calloc((size_t)nx*ny, 1);
+  if (map == NULL) die("cannot allocate memory for the obstacle map",__LINE__,__FILE__);
+
+  /* the walls */
+  for(jj=0;jj<nx;jj++) {
+    map[jj] = 1;
+    map[(size_t)(ny-1)*nx + jj] = 1;
+  }
+  blocked = 2L*nx;
+
+  /* then obstacles until enough of the cells are blocked, which
+  ** the walls alone may already be */
+  radius = ny/16 > 1 ? ny/16 : 1;
+  target = (long)(solid*nx*ny);
+  while(blocked < target) {
+    xx = next_random(&seed) % nx;
+    yy = next_random(&seed) % ny;
+    for(ii=-radius;ii<=radius && blocked<target;ii++) {
+      for(jj=-radius;jj<=radius && blocked<target;jj++) {
+        const size_t cell = (size_t)((yy+ii+ny)%ny)*nx + (xx+jj+nx)%nx;
+        if(ii*ii + jj*jj > radius*radius || map[cell]) continue;
+        map[cell] = 1;
+        blocked++;
+      }
+    }
+  }
+
+  fp = fopen(argv[6],"w");
+  if (fp == NULL) die("could not open obstacle file",__LINE__,__FILE__);
+  for(ii=0;ii<ny;ii++) {
+    for(jj=0;jj<nx;jj++) {
+      if(map[(size_t)ii*nx + jj]) fprintf(fp,"%d %d 1\n", jj, ii);
+    }
+  }
+  fclose(fp);
+  free(map);
+
+  printf("%dx%d, %.3f solid\n", nx, ny, (double)blocked/((double)nx*ny));
+
+  return EXIT_SUCCESS;
+}
+
+unsigned int next_random(unsigned int* state)
+{
+  unsigned int x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+
+  return x;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
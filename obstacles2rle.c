@@ -0,0 +1,107 @@
+/*
+** Turn a text obstacle file, one blocked cell per line:
+**
+**   x y 1
+**
+** into the compact binary form d2q9-bgk.exe also reads, in which
+** each run of blocked cells along a row is stored once, e.g.
+**
+**   gcc -O2 -o obstacles2rle obstacles2rle.c
+**   ./obstacles2rle 300 200 obstacles_300x200.dat obstacles_300x200.rle
+**
+** The binary file is a header with the grid size and the no. of
+** runs, then three ints per run: the row, the first column and the
+** no. of cells.  Both ends must agree on t_obstacle_header and the
+** byte order, i.e. convert on the machine that runs the job.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#define OBSTACLE_MAGIC  "D2OB"  /* first bytes of a binary obstacle file */
+
+/* header of a binary obstacle file, as in d2q9-bgk.c */
+typedef struct {
+  char magic[4];        /* OBSTACLE_MAGIC */
+  int  nx;              /* no. of cells in x-direction */
+  int  ny;              /* no. of cells in y-direction */
+  int  nruns;           /* no. of runs */
+} t_obstacle_header;
+
+void die(const char* message, const int line, const char *file);
+
+int main(int argc, char* argv[])
+{
+  FILE* in;                  /* the text obstacle file */
+  FILE* out;                 /* and its binary version */
+  t_obstacle_header header;
+  unsigned char* map;        /* the blocked cells of the whole grid */
+  int run[3];                /* row, first column & no. of cells */
+  int xx,yy;                 /* generic array indices */
+  int blocked;               /* indicates whether a cell is blocked */
+  int retval;                /* to hold return value for checking */
+  int ii,jj;                 /* generic counters */
+
+  if(argc != 5) {
+    fprintf(stderr, "Usage: %s <nx> <ny> <obstacles.dat> <obstacles.rle>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(header.magic, OBSTACLE_MAGIC, sizeof(header.magic));
+  header.nx = atoi(argv[1]);
+  header.ny = atoi(argv[2]);
+  header.nruns = 0;
+  if(header.nx < 1 || header.ny < 1) die("bad grid size",__LINE__,__FILE__);
+
+  map = (unsigned char*)calloc((size_t)header.nx*header.ny, 1);
+  if (map == NULL) die("cannot allocate memory for the obstacle map",__LINE__,__FILE__);
+
+  in = fopen(argv[3],"r");
+  if (in == NULL) die("could not open input file",__LINE__,__FILE__);
+  while( (retval = fscanf(in,"%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
+    if ( retval != 3)
+      die("expected 3 values per line in obstacle file",__LINE__,__FILE__);
+    if ( xx<0 || xx>header.nx-1 || yy<0 || yy>header.ny-1 )
+      die("obstacle coords out of range",__LINE__,__FILE__);
+    if ( blocked != 1 )
+      die("obstacle blocked value should be 1",__LINE__,__FILE__);
+    map[(size_t)yy*header.nx + xx] = 1;
+  }
+  fclose(in);
+
+  out = fopen(argv[4],"wb");
+  if (out == NULL) die("could not open output file",__LINE__,__FILE__);
+
+  /* the header is rewritten once the runs are counted */
+  fwrite(&header, sizeof(header), 1, out);
+  for(ii=0;ii<header.ny;ii++) {
+    for(jj=0;jj<header.nx;) {
+      if(!map[(size_t)ii*header.nx + jj]) {
+        jj++;
+        continue;
+      }
+      run[0] = ii;
+      run[1] = jj;
+      while(jj < header.nx && map[(size_t)ii*header.nx + jj]) jj++;
+      run[2] = jj - run[1];
+      if(fwrite(run, sizeof(int), 3, out) != 3) die("could not write output file",__LINE__,__FILE__);
+      header.nruns++;
+    }
+  }
+  if(fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1)
+    die("could not write output file",__LINE__,__FILE__);
+
+  free(map);
+  fclose(out);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,100 @@
+/*
+** Turn a binary final state, as written by
+**
+**   d2q9-bgk.exe --output binary input.params obstacles.dat
+**
+** back into the text format of final_state.dat, one line per cell:
+**
+**   row column u_x u_y pressure obstacle
+**
+** e.g.
+**
+**   gcc -O2 -o state2txt state2txt.c
+**   ./state2txt final_state.bin final_state.dat
+**
+** The binary file is a header, then four planes of ny*nx values in
+** row major order: u_x, u_y and pressure as floats, then the
+** obstacles as one byte each.  Both ends must agree on t_state_header
+** and the byte order, i.e. convert on the machine that ran the job.
+*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+
+#define STATE_MAGIC     "D2Q9"  /* first bytes of a binary final state */
+
+/* header of a binary final state, as in d2q9-bgk.c */
+typedef struct {
+  char magic[4];        /* STATE_MAGIC */
+  int  nx;              /* no. of cells in x-direction */
+  int  ny;              /* no. of cells in y-direction */
+  int  dtype;           /* bytes per float value */
+} t_state_header;
+
+void die(const char* message, const int line, const char *file);
+
+int main(int argc, char* argv[])
+{
+  FILE* in;                  /* the binary final state */
+  FILE* out;                 /* and its text version */
+  t_state_header header;
+  float* fields;             /* a row of u_x, u_y & pressure */
+  unsigned char* obstacles;  /* and of the obstacles */
+  long plane;                /* bytes in a float plane */
+  int ii,jj,kk;              /* generic counters */
+
+  if(argc != 3) {
+    fprintf(stderr, "Usage: %s <final_state.bin> <final_state.dat>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  in = fopen(argv[1],"rb");
+  if (in == NULL) die("could not open input file",__LINE__,__FILE__);
+  if(fread(&header, sizeof(header), 1, in) != 1 ||
+     memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0)
+    die("not a binary final state",__LINE__,__FILE__);
+  if(header.dtype != sizeof(float))
+    die("only float final states are supported",__LINE__,__FILE__);
+
+  out = fopen(argv[2],"w");
+  if (out == NULL) die("could not open output file",__LINE__,__FILE__);
+
+  fields = (float*)malloc(sizeof(float)*3*header.nx);
+  obstacles = (unsigned char*)malloc(header.nx);
+  if (fields == NULL || obstacles == NULL)
+    die("cannot allocate memory for a row",__LINE__,__FILE__);
+
+  /* gather each row from the four planes */
+  plane = (long)header.nx*header.ny*sizeof(float);
+  for(ii=0;ii<header.ny;ii++) {
+    for(kk=0;kk<3;kk++) {
+      if(fseek(in, sizeof(header) + kk*plane + (long)ii*header.nx*sizeof(float), SEEK_SET) != 0 ||
+         fread(&fields[kk*header.nx], sizeof(float), header.nx, in) != (size_t)header.nx)
+        die("final state is truncated",__LINE__,__FILE__);
+    }
+    if(fseek(in, sizeof(header) + 3*plane + (long)ii*header.nx, SEEK_SET) != 0 ||
+       fread(obstacles, 1, header.nx, in) != (size_t)header.nx)
+      die("final state is truncated",__LINE__,__FILE__);
+
+    for(jj=0;jj<header.nx;jj++) {
+      fprintf(out,"%d %d %.12E %.12E %.12E %d\n", ii, jj,
+              fields[jj], fields[header.nx+jj], fields[2*header.nx+jj], obstacles[jj]);
+    }
+  }
+
+  free(fields);
+  free(obstacles);
+  fclose(in);
+  fclose(out);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char *file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n",message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}